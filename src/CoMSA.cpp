@@ -29,7 +29,19 @@ task_mode_t mode;
 vector<string> v_in_names;
 string out_name;
 int wrap_width = 0;
-bool fast_variant = false;
+second_stage_t second_stage = second_stage_t::wfc;
+bool column_info_mode = false;
+bool gap_mask_mode = false;
+bool sub_matrices_mode = true;
+bool entropy_blocks_mode = false;
+entropy_backend_t entropy_backend = entropy_backend_t::range_coder;
+bool run_lengths_mode = false;
+bool ctx_trial_mode = false;
+bool super_blocks_mode = false;
+bool text_dictionary_mode = true;
+bool gs_fields_mode = true;
+bool annotation_rows_mode = true;
+int n_threads = 0;
 string extract_ID;
 string extract_AC;
 bool extract_sequences_only = false;
@@ -57,6 +69,10 @@ bool Stockholm_decompress();
 bool Stockholm_extract();
 bool Stockholm_list();
 
+bool store_text_dictionary(CCompressedStockholmFile &csf);
+bool store_super_block(CCompressedStockholmFile &csf, vector<msa_family_t> &v_group, vector<stockholm_family_desc_t> &v_group_desc,
+	vector<stockholm_family_desc_t> &v_fam_desc, size_t &total_comp_text_size, size_t &total_comp_seq_size);
+
 bool parse_params(int argc, char **argv);
 void usage();
 
@@ -80,6 +96,19 @@ void usage()
 	cout << "Options:\n";
 	cout << "   -w <width>   - wrap sequences in FASTA file to given length (only for Fd mode); default: 0 (no wrapping)\n";
 	cout << "   -f           - turn on fast variant (MTF in place of WFC)\n";
+	cout << "   -fa          - choose MTF or WFC automatically for each family\n";
+	cout << "   -ci          - describe constant, repeated and near-constant columns separately (smaller output for some families)\n";
+	cout << "   -gm          - code gaps separately from residues (faster for gappy families)\n";
+	cout << "   -ns          - do not split families into match and insert columns\n";
+	cout << "   -eb          - entropy code columns in independent blocks (parallel decompression of large families)\n";
+	cout << "   -turbo       - use static Huffman codes in place of range coder (implies -eb); 2-5% larger output, faster decompression with -f\n";
+	cout << "   -rl          - code lengths of zero-runs in the entropy coder (no separate RLE-0 stage)\n";
+	cout << "   -tc          - select context lengths by trial coding of columns (slower compression)\n";
+	cout << "   -sb          - compress consecutive small families together in super-blocks (only for 'Sc' mode)\n";
+	cout << "   -nd          - do not use preset dictionary of metadata trained on the first families (only for 'Sc' mode)\n";
+	cout << "   -ng          - do not code fields of #=GS lines in separate streams (only for 'Sc' mode)\n";
+	cout << "   -na          - do not compress per-column annotations (#=GR, #=GC lines) as a separate matrix (only for 'Sc' mode)\n";
+	cout << "   -t <n>       - no. of threads; default: no. of cores\n";
 	cout << "   -eID <id>    - extract family of given id (only for 'Se' mode)\n";
 	cout << "   -eAC <ac>    - extract family of given accession number (only for 'Se' mode)\n";
 	cout << "   -es          - extract sequences only (without gaps)\n";
@@ -138,9 +167,74 @@ bool parse_params(int argc, char **argv)
 		}
 		else if (strcmp(argv[arg_no], "-f") == 0 && arg_no + 1 < argc)
 		{
-			fast_variant = true;
+			second_stage = second_stage_t::mtf;
+			arg_no++;
+		}
+		else if (strcmp(argv[arg_no], "-fa") == 0 && arg_no + 1 < argc)
+		{
+			second_stage = second_stage_t::automatic;
+			arg_no++;
+		}
+		else if (strcmp(argv[arg_no], "-ci") == 0 && arg_no + 1 < argc)
+		{
+			column_info_mode = true;
+			arg_no++;
+		}
+		else if (strcmp(argv[arg_no], "-gm") == 0 && arg_no + 1 < argc)
+		{
+			gap_mask_mode = true;
+			arg_no++;
+		}
+		else if (strcmp(argv[arg_no], "-ns") == 0 && arg_no + 1 < argc)
+		{
+			sub_matrices_mode = false;
+			arg_no++;
+		}
+		else if (strcmp(argv[arg_no], "-eb") == 0 && arg_no + 1 < argc)
+		{
+			entropy_blocks_mode = true;
+			arg_no++;
+		}
+		else if (strcmp(argv[arg_no], "-turbo") == 0 && arg_no + 1 < argc)
+		{
+			entropy_backend = entropy_backend_t::huffman;
+			arg_no++;
+		}
+		else if (strcmp(argv[arg_no], "-rl") == 0 && arg_no + 1 < argc)
+		{
+			run_lengths_mode = true;
+			arg_no++;
+		}
+		else if (strcmp(argv[arg_no], "-tc") == 0 && arg_no + 1 < argc)
+		{
+			ctx_trial_mode = true;
+			arg_no++;
+		}
+		else if (strcmp(argv[arg_no], "-sb") == 0 && arg_no + 1 < argc)
+		{
+			super_blocks_mode = true;
+			arg_no++;
+		}
+		else if (strcmp(argv[arg_no], "-nd") == 0 && arg_no + 1 < argc)
+		{
+			text_dictionary_mode = false;
+			arg_no++;
+		}
+		else if (strcmp(argv[arg_no], "-ng") == 0 && arg_no + 1 < argc)
+		{
+			gs_fields_mode = false;
 			arg_no++;
 		}
+		else if (strcmp(argv[arg_no], "-na") == 0 && arg_no + 1 < argc)
+		{
+			annotation_rows_mode = false;
+			arg_no++;
+		}
+		else if (strcmp(argv[arg_no], "-t") == 0 && arg_no + 2 < argc)
+		{
+			n_threads = NORM(atoi(argv[arg_no + 1]), 1, 256);
+			arg_no += 2;
+		}
 		else if (strcmp(argv[arg_no], "-es") == 0 && arg_no + 1 < argc)
 		{
 			extract_sequences_only = true;
@@ -245,7 +339,7 @@ bool FASTA_compress()
 	size_t comp_text_size;
 	size_t comp_seq_size;
 
-	msac->Compress(v_names, v_sequences, v_compressed_data, comp_text_size, comp_seq_size, fast_variant);
+	msac->Compress(v_names, v_sequences, v_compressed_data, comp_text_size, comp_seq_size, second_stage);
 
 	if (!CCompressedFastaFile::Save(out_name, v_compressed_data))
 		return false;
@@ -270,7 +364,11 @@ bool FASTA_decompress()
 	if (!CCompressedFastaFile::Load(v_in_names.front(), v_compressed_data))
 		return false;
 
-	msac->Decompress(v_compressed_data, v_names, v_sequences);
+	if (!msac->Decompress(v_compressed_data, v_names, v_sequences))
+	{
+		cerr << "Fatal error during decompression\n";
+		return false;
+	}
 
 	fasta.PutSequences(v_names, v_sequences, wrap_width, extract_sequences_only);
 
@@ -299,6 +397,10 @@ bool Stockholm_compress()
 
 	vector<stockholm_family_desc_t> v_fam_desc;
 
+	// Small families waiting for compression in a super-block
+	vector<msa_family_t> v_group;
+	vector<stockholm_family_desc_t> v_group_desc;
+
 	if (!csf.OpenForWriting(out_name))
 		return false;
 
@@ -306,6 +408,9 @@ bool Stockholm_compress()
 	size_t total_comp_seq_size = 0;
 	uint32_t dataset_no = 0;
 
+	if (text_dictionary_mode && !store_text_dictionary(csf))
+		return false;
+
 	for (auto &sto_name : v_in_names)
 	{
 		if (!sf.OpenForReading(sto_name))
@@ -332,31 +437,60 @@ bool Stockholm_compress()
 				continue;
 
 			size_t f_pos2 = sf.GetPos();
+			size_t n_columns = v_sequences.empty() ? 0 : v_sequences.front().size();
 
-			if (!msac->Compress(v_meta, v_offsets, v_names, v_sequences, v_compressed_data, comp_text_size, comp_seq_size, fast_variant))
+			if (super_blocks_mode && v_sequences.size() * n_columns < SUPER_BLOCK_FAMILY_MAX_SIZE)
 			{
-				cerr << "Fatal error during compression\n";
-				return false;
+				v_group_desc.push_back(stockholm_family_desc_t(v_sequences.size(), n_columns, f_pos2 - f_pos1, 0, 0, ID, AC));
+				v_group.push_back(msa_family_t());
+				v_group.back().v_meta = move(v_meta);
+				v_group.back().v_offsets = move(v_offsets);
+				v_group.back().v_names = move(v_names);
+				v_group.back().v_sequences = move(v_sequences);
+
+				size_t group_size = 0;
+				for (auto &x : v_group)
+					group_size += x.size();
+
+				if (group_size >= SUPER_BLOCK_SIZE || v_group.size() >= SUPER_BLOCK_MAX_FAMILIES)
+					if (!store_super_block(csf, v_group, v_group_desc, v_fam_desc, total_comp_text_size, total_comp_seq_size))
+						return false;
 			}
-
-			v_fam_desc.push_back(stockholm_family_desc_t(
-				v_sequences.size(),
-				v_sequences.empty() ? 0 : v_sequences.front().size(),
-				f_pos2 - f_pos1,
-				comp_text_size + comp_seq_size,
-				csf.GetPos(),
-				ID,
-				AC
-			));
-
-			if (!csf.Store(v_compressed_data))
+			else
 			{
-				cerr << "Fatal error during saving compressed data\n";
-				return false;
+				// Families are stored in the order of the input file
+				if (!store_super_block(csf, v_group, v_group_desc, v_fam_desc, total_comp_text_size, total_comp_seq_size))
+					return false;
+
+				if (!msac->Compress(v_meta, v_offsets, v_names, v_sequences, v_compressed_data, comp_text_size, comp_seq_size, second_stage))
+				{
+					cerr << "Fatal error during compression\n";
+					return false;
+				}
+
+				v_fam_desc.push_back(stockholm_family_desc_t(
+					v_sequences.size(),
+					n_columns,
+					f_pos2 - f_pos1,
+					comp_text_size + comp_seq_size,
+					csf.GetPos(),
+					ID,
+					AC
+				));
+
+				if (!csf.Store(v_compressed_data))
+				{
+					cerr << "Fatal error during saving compressed data\n";
+					return false;
+				}
+
+				total_comp_text_size += comp_text_size;
+				total_comp_seq_size += comp_seq_size;
 			}
 
-			total_comp_text_size += comp_text_size;
-			total_comp_seq_size += comp_seq_size;
+			// Nothing is stored yet (small families wait for their super-block)
+			if (total_comp_text_size + total_comp_seq_size == 0)
+				continue;
 
 			if (total_comp_text_size + total_comp_seq_size < 20000)
 				cout << "Dataset no. " << dataset_no++
@@ -375,6 +509,9 @@ bool Stockholm_compress()
 		sf.Close();
 	}
 
+	if (!store_super_block(csf, v_group, v_group_desc, v_fam_desc, total_comp_text_size, total_comp_seq_size))
+		return false;
+
 	// Store family descriptions
 	csf.StoreFamilyDescriptions(v_fam_desc);
 
@@ -411,28 +548,41 @@ bool Stockholm_decompress()
 
 	while (!csf.Eof())
 	{
-		vector<vector<uint8_t>> v_meta;
-		vector<uint32_t> v_offsets;
-		vector<string> v_names;
-		vector<string> v_sequences;
+		vector<msa_family_t> v_families(1);
 		vector<uint8_t> v_compressed_data;
 
 		if (!csf.Load(v_compressed_data))
 			break;
 
-		if (!msac->Decompress(v_compressed_data, v_meta, v_offsets, v_names, v_sequences))
+		bool ok;
+		if (msac->IsTextDictionary(v_compressed_data))
 		{
-			cerr << "Fatal error during decompression\n";
-			return false;
+			if (msac->LoadTextDictionary(v_compressed_data))
+				continue;
+
+			ok = false;
 		}
+		else if (msac->IsSuperBlock(v_compressed_data))
+			ok = msac->DecompressSuperBlock(v_compressed_data, v_families);
+		else
+			ok = msac->Decompress(v_compressed_data, v_families[0].v_meta, v_families[0].v_offsets, v_families[0].v_names, v_families[0].v_sequences);
 
-		if (!sf.PutSequences(v_meta, v_offsets, v_names, v_sequences, wrap_width, extract_sequences_only))
+		if (!ok)
 		{
-			cerr << "Fatal error during saving compressed data\n";
+			cerr << "Fatal error during decompression\n";
 			return false;
 		}
 
-		cout << "Dataset no. " << dataset_no++ << "\r";
+		for (auto &x : v_families)
+		{
+			if (!sf.PutSequences(x.v_meta, x.v_offsets, x.v_names, x.v_sequences, wrap_width, extract_sequences_only))
+			{
+				cerr << "Fatal error during saving compressed data\n";
+				return false;
+			}
+
+			cout << "Dataset no. " << dataset_no++ << "\r";
+		}
 	}
 
 	cout << endl;
@@ -470,8 +620,24 @@ bool Stockholm_extract()
 
 	uint32_t dataset_no = 0;
 
-	for(auto &fd : v_fam_desc)
+	// The preset dictionary of metadata (if present) is the first block of archive
+	vector<uint8_t> v_dictionary_data;
+	if (!v_fam_desc.empty() && csf.SetPos(0) && csf.Load(v_dictionary_data) && msac->IsTextDictionary(v_dictionary_data) && 
+		!msac->LoadTextDictionary(v_dictionary_data))
 	{
+		cerr << "Fatal error during decompression\n";
+		return false;
+	}
+
+	int family_no = 0;
+
+	for (size_t i = 0; i < v_fam_desc.size(); ++i)
+	{
+		auto &fd = v_fam_desc[i];
+
+		// Families of a super-block share the pointer to compressed data
+		family_no = (i && v_fam_desc[i - 1].compressed_data_ptr == fd.compressed_data_ptr) ? family_no + 1 : 0;
+
 		if (!extract_ID.empty() && fd.ID != extract_ID)
 			continue;
 		if (!extract_AC.empty() && fd.AC != extract_AC)
@@ -479,22 +645,27 @@ bool Stockholm_extract()
 
 		csf.SetPos(fd.compressed_data_ptr);
 
-		vector<vector<uint8_t>> v_meta;
-		vector<uint32_t> v_offsets;
-		vector<string> v_names;
-		vector<string> v_sequences;
+		vector<msa_family_t> v_families(1);
 		vector<uint8_t> v_compressed_data;
 
 		if (!csf.Load(v_compressed_data))
 			break;
 
-		if (!msac->Decompress(v_compressed_data, v_meta, v_offsets, v_names, v_sequences))
+		bool ok;
+		if (msac->IsSuperBlock(v_compressed_data))
+			ok = msac->DecompressSuperBlock(v_compressed_data, v_families, family_no);
+		else
+			ok = msac->Decompress(v_compressed_data, v_families[0].v_meta, v_families[0].v_offsets, v_families[0].v_names, v_families[0].v_sequences);
+
+		if (!ok || (size_t) family_no >= v_families.size())
 		{
 			cerr << "Fatal error during decompression\n";
 			return false;
 		}
 
-		if (!sf.PutSequences(v_meta, v_offsets, v_names, v_sequences, wrap_width, extract_sequences_only))
+		auto &family = v_families[family_no];
+
+		if (!sf.PutSequences(family.v_meta, family.v_offsets, family.v_names, family.v_sequences, wrap_width, extract_sequences_only))
 		{
 			cerr << "Fatal error during saving compressed data\n";
 			return false;
@@ -518,6 +689,110 @@ bool Stockholm_extract()
 	return true;
 }
 
+// *******************************************************************************************
+// Train the preset dictionary of metadata on the first families of the first input file and store it as the first block
+bool store_text_dictionary(CCompressedStockholmFile &csf)
+{
+	CStockholmFile sf;
+	vector<msa_family_t> v_sample;
+	size_t sample_size = 0;
+
+	if (!sf.OpenForReading(v_in_names.front()))
+	{
+		cout << "Cannot open: " << v_in_names.front() << endl;
+		return false;
+	}
+
+	while (!sf.Eof() && v_sample.size() < TEXT_DICTIONARY_SAMPLE_FAMILIES && sample_size < TEXT_DICTIONARY_SAMPLE_SIZE)
+	{
+		msa_family_t family;
+		string ID, AC;
+
+		if (!sf.GetSequences(family.v_meta, family.v_offsets, family.v_names, family.v_sequences, ID, AC))
+			continue;
+
+		// Only the alignment width is necessary to find per-column annotations
+		family.v_sequences.resize(min<size_t>(family.v_sequences.size(), 1));
+		for (auto &x : family.v_meta)
+			sample_size += x.size();
+		for (auto &x : family.v_names)
+			sample_size += x.size();
+
+		v_sample.push_back(move(family));
+	}
+
+	sf.Close();
+
+	// A single family cannot gain anything from the dictionary
+	if (v_sample.size() < 2)
+		return true;
+
+	vector<uint8_t> v_compressed_data;
+	msac->TrainTextDictionary(v_sample, v_compressed_data);
+
+	if (!csf.Store(v_compressed_data))
+	{
+		cerr << "Fatal error during saving compressed data\n";
+		return false;
+	}
+
+	return true;
+}
+
+// *******************************************************************************************
+// Compress the collected small families as a single super-block.
+// The compressed size of the super-block is divided among its families proportionally to their raw sizes.
+bool store_super_block(CCompressedStockholmFile &csf, vector<msa_family_t> &v_group, vector<stockholm_family_desc_t> &v_group_desc,
+	vector<stockholm_family_desc_t> &v_fam_desc, size_t &total_comp_text_size, size_t &total_comp_seq_size)
+{
+	if (v_group.empty())
+		return true;
+
+	vector<uint8_t> v_compressed_data;
+	size_t comp_text_size;
+	size_t comp_seq_size;
+
+	if (!msac->CompressSuperBlock(v_group, v_compressed_data, comp_text_size, comp_seq_size, second_stage))
+	{
+		cerr << "Fatal error during compression\n";
+		return false;
+	}
+
+	size_t raw_size = 0;
+	for (auto &x : v_group_desc)
+		raw_size += x.raw_size;
+
+	size_t comp_size = comp_text_size + comp_seq_size;
+	size_t cum_raw_size = 0;
+	size_t cum_comp_size = 0;
+
+	for (auto &x : v_group_desc)
+	{
+		cum_raw_size += x.raw_size;
+		size_t next_cum_comp_size = raw_size ? (size_t) ((double) comp_size * cum_raw_size / raw_size) : 0;
+
+		x.compressed_size = next_cum_comp_size - cum_comp_size;
+		x.compressed_data_ptr = csf.GetPos();
+		cum_comp_size = next_cum_comp_size;
+
+		v_fam_desc.push_back(x);
+	}
+
+	if (!csf.Store(v_compressed_data))
+	{
+		cerr << "Fatal error during saving compressed data\n";
+		return false;
+	}
+
+	total_comp_text_size += comp_text_size;
+	total_comp_seq_size += comp_seq_size;
+
+	v_group.clear();
+	v_group_desc.clear();
+
+	return true;
+}
+
 // *******************************************************************************************
 bool Stockholm_list()
 {
@@ -557,6 +832,19 @@ int main(int argc, char **argv)
 		return 0;
 
 	msac = new CMSACompress();
+	msac->SetColumnInfoMode(column_info_mode);
+	msac->SetGapMaskMode(gap_mask_mode);
+	msac->SetSubMatricesMode(sub_matrices_mode);
+	msac->SetEntropyBlockSize(entropy_blocks_mode ? ENTROPY_BLOCK_SIZE : 0);
+	msac->SetEntropyBackend(entropy_backend);
+	msac->SetRunLengthsMode(run_lengths_mode);
+	msac->SetCtxTrialMode(ctx_trial_mode);
+	msac->SetGSFieldsMode(gs_fields_mode);
+	msac->SetAnnotationRowsMode(annotation_rows_mode);
+
+	if (!n_threads)
+		n_threads = max((int) thread::hardware_concurrency(), 1);
+	msac->SetNoThreads(n_threads);
 
 #ifdef EXPERIMENTAL_MODE
 	msac->SetCopyModes(Transpose_copy_mode, PBWT_copy_mode, SS_copy_mode, RLE0_copy_mode);
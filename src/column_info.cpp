@@ -0,0 +1,278 @@
+// *******************************************************************************************
+// This file is a part of CoMSA software distributed under GNU GPL 3 licence.
+// The homepage of the CoMSA project is http://sun.aei.polsl.pl/REFRESH/CoMSA
+//
+// Author : Sebastian Deorowicz
+// Version: 1.2
+// Date   : 2018-10-04
+// *******************************************************************************************
+
+#include "column_info.h"
+
+// *******************************************************************************************
+//
+CColumnInfo::CColumnInfo()
+{
+	fill_n(rc_kind, 4, nullptr);
+	fill_n(rc_symbol, 2, nullptr);
+	rc_n_exceptions = nullptr;
+	rc_same_row = nullptr;
+	rc_exception_symbol = nullptr;
+
+	Clear();
+}
+
+// *******************************************************************************************
+//
+CColumnInfo::~CColumnInfo()
+{
+	delete_rc();
+}
+
+// *******************************************************************************************
+void CColumnInfo::Clear()
+{
+	v_kinds.clear();
+	v_symbols.clear();
+	v_exceptions.clear();
+	v_exceptions_pos.clear();
+	v_exceptions_pos.push_back(0);
+
+	n_regular = 0;
+}
+
+// *******************************************************************************************
+void CColumnInfo::AddRegular()
+{
+	v_kinds.push_back(column_kind_t::regular);
+	v_symbols.push_back(0);
+	v_exceptions_pos.push_back((uint32_t) v_exceptions.size());
+	++n_regular;
+}
+
+// *******************************************************************************************
+void CColumnInfo::AddConstant(uint8_t symbol)
+{
+	v_kinds.push_back(column_kind_t::constant);
+	v_symbols.push_back(symbol);
+	v_exceptions_pos.push_back((uint32_t) v_exceptions.size());
+}
+
+// *******************************************************************************************
+void CColumnInfo::AddRepeated()
+{
+	v_kinds.push_back(column_kind_t::repeated);
+	v_symbols.push_back(0);
+	v_exceptions_pos.push_back((uint32_t) v_exceptions.size());
+}
+
+// *******************************************************************************************
+// Exceptions must be sorted according to row numbers
+void CColumnInfo::AddNearConstant(uint8_t symbol, vector<pair<uint32_t, uint8_t>> &v_col_exceptions)
+{
+	v_kinds.push_back(column_kind_t::near_constant);
+	v_symbols.push_back(symbol);
+	v_exceptions.insert(v_exceptions.end(), v_col_exceptions.begin(), v_col_exceptions.end());
+	v_exceptions_pos.push_back((uint32_t) v_exceptions.size());
+}
+
+// *******************************************************************************************
+// Initialize range coder models
+void CColumnInfo::init_rc(CBasicRangeCoder<CVectorIOStream> *rcb, bool compress)
+{
+	delete_rc();
+
+	for (int i = 0; i < 4; ++i)
+		rc_kind[i] = new CRangeCoderModel<CVectorIOStream>(rcb, 4, 10, 1 << 10, nullptr, compress);
+	for (int i = 0; i < 2; ++i)
+		rc_symbol[i] = new CRangeCoderModel<CVectorIOStream>(rcb, 128, 12, 1 << 12, nullptr, compress);
+	rc_n_exceptions = new CRangeCoderModel<CVectorIOStream>(rcb, NEAR_CONSTANT_MAX_EXCEPTIONS, 10, 1 << 10, nullptr, compress);
+	rc_same_row = new CRangeCoderModel<CVectorIOStream>(rcb, 2, 10, 1 << 10, nullptr, compress);
+	rc_exception_symbol = new CRangeCoderModel<CVectorIOStream>(rcb, 128, 12, 1 << 12, nullptr, compress);
+}
+
+// *******************************************************************************************
+// Delete range coder models
+void CColumnInfo::delete_rc()
+{
+	for (auto &x : rc_kind)
+	{
+		delete x;
+		x = nullptr;
+	}
+
+	for (auto &x : rc_symbol)
+	{
+		delete x;
+		x = nullptr;
+	}
+
+	delete rc_n_exceptions;
+	delete rc_same_row;
+	delete rc_exception_symbol;
+
+	rc_n_exceptions = nullptr;
+	rc_same_row = nullptr;
+	rc_exception_symbol = nullptr;
+}
+
+// *******************************************************************************************
+// Encode row number (uniform distribution)
+void CColumnInfo::encode_row(CRangeEncoder<CVectorIOStream> &rce, uint32_t row, uint32_t n_rows)
+{
+	if (n_rows <= (1u << 16))
+		rce.EncodeFrequency(1, row, n_rows);
+	else
+	{
+		rce.EncodeFrequency(1, row >> 16, ((n_rows - 1) >> 16) + 1);
+		rce.EncodeFrequency(1, row & 0xffff, 1 << 16);
+	}
+}
+
+// *******************************************************************************************
+// Decode row number (uniform distribution)
+uint32_t CColumnInfo::decode_row(CRangeDecoder<CVectorIOStream> &rcd, uint32_t n_rows)
+{
+	if (n_rows <= (1u << 16))
+	{
+		uint32_t row = rcd.GetCumulativeFreq(n_rows);
+		rcd.UpdateFrequency(1, row, n_rows);
+
+		return row;
+	}
+
+	uint32_t tot_hi = ((n_rows - 1) >> 16) + 1;
+	uint32_t hi = rcd.GetCumulativeFreq(tot_hi);
+	rcd.UpdateFrequency(1, hi, tot_hi);
+
+	uint32_t lo = rcd.GetCumulativeFreq(1 << 16);
+	rcd.UpdateFrequency(1, lo, 1 << 16);
+
+	return (hi << 16) + lo;
+}
+
+// *******************************************************************************************
+// Encode column descriptions.
+// Rows of exceptions in consecutive near-constant columns are often the same (insertions
+// in a single sequence spanning many columns), so such rows are coded just as flags.
+void CColumnInfo::Encode(vector<uint8_t> &v_compressed, uint32_t n_rows)
+{
+	v_compressed.clear();
+
+	CVectorIOStream vios(v_compressed);
+	CRangeEncoder<CVectorIOStream> rce(vios);
+
+	init_rc(&rce, true);
+	rce.Start();
+
+	int ctx_kind = 0;
+	const pair<uint32_t, uint8_t> *prev_exc_begin = nullptr;
+	const pair<uint32_t, uint8_t> *prev_exc_end = nullptr;
+
+	for (size_t i = 0; i < v_kinds.size(); ++i)
+	{
+		column_kind_t kind = v_kinds[i];
+		rc_kind[ctx_kind]->Encode((int) kind);
+		ctx_kind = (int) kind;
+
+		if (kind == column_kind_t::constant)
+			rc_symbol[0]->Encode(v_symbols[i]);
+		else if (kind == column_kind_t::near_constant)
+		{
+			rc_symbol[1]->Encode(v_symbols[i]);
+
+			auto p_begin = ExceptionsBegin(i);
+			auto p_end = ExceptionsEnd(i);
+
+			rc_n_exceptions->Encode((int) (p_end - p_begin) - 1);
+
+			auto q = prev_exc_begin;
+			for (auto p = p_begin; p != p_end; ++p)
+			{
+				if (q != prev_exc_end)
+				{
+					bool same = q->first == p->first;
+					rc_same_row->Encode(same);
+					++q;
+
+					if (!same)
+						encode_row(rce, p->first, n_rows);
+				}
+				else
+					encode_row(rce, p->first, n_rows);
+
+				rc_exception_symbol->Encode(p->second);
+			}
+
+			prev_exc_begin = p_begin;
+			prev_exc_end = p_end;
+		}
+	}
+
+	rce.End();
+	delete_rc();
+}
+
+// *******************************************************************************************
+// Decode column descriptions. Returns false for corrupted data.
+bool CColumnInfo::Decode(vector<uint8_t> &v_compressed, uint32_t n_rows, size_t n_columns)
+{
+	Clear();
+
+	CVectorIOStream vios(v_compressed);
+	CRangeDecoder<CVectorIOStream> rcd(vios);
+
+	init_rc(&rcd, false);
+	rcd.Start();
+
+	int ctx_kind = 0;
+	vector<pair<uint32_t, uint8_t>> v_col_exceptions, v_prev_exceptions;
+
+	for (size_t i = 0; i < n_columns; ++i)
+	{
+		column_kind_t kind = (column_kind_t) rc_kind[ctx_kind]->Decode();
+		ctx_kind = (int) kind;
+
+		if (kind == column_kind_t::regular)
+			AddRegular();
+		else if (kind == column_kind_t::repeated)
+			AddRepeated();
+		else if (kind == column_kind_t::constant)
+			AddConstant((uint8_t) rc_symbol[0]->Decode());
+		else
+		{
+			uint8_t symbol = (uint8_t) rc_symbol[1]->Decode();
+			uint32_t n_exceptions = rc_n_exceptions->Decode() + 1;
+
+			v_col_exceptions.clear();
+
+			for (uint32_t j = 0; j < n_exceptions; ++j)
+			{
+				uint32_t row;
+
+				if (j < v_prev_exceptions.size() && rc_same_row->Decode())
+					row = v_prev_exceptions[j].first;
+				else
+					row = decode_row(rcd, n_rows);
+
+				if (row >= n_rows || (!v_col_exceptions.empty() && row <= v_col_exceptions.back().first))
+				{
+					delete_rc();
+					return false;
+				}
+
+				v_col_exceptions.push_back(make_pair(row, (uint8_t) rc_exception_symbol->Decode()));
+			}
+
+			AddNearConstant(symbol, v_col_exceptions);
+			v_prev_exceptions.swap(v_col_exceptions);
+		}
+	}
+
+	rcd.End();
+	delete_rc();
+
+	return !vios.Overrun();
+}
+
+// EOF
@@ -0,0 +1,99 @@
+#pragma once
+// *******************************************************************************************
+// This file is a part of CoMSA software distributed under GNU GPL 3 licence.
+// The homepage of the CoMSA project is http://sun.aei.polsl.pl/REFRESH/CoMSA
+//
+// Author : Sebastian Deorowicz
+// Version: 1.2
+// Date   : 2018-10-04
+// *******************************************************************************************
+
+#include <vector>
+#include <string>
+#include "defs.h"
+#include "rc.h"
+
+using namespace std;
+
+// Kinds of columns:
+//   * regular       - processed by the complete pipeline (gPBWT, MTF/WFC, RLE-0, entropy coding)
+//   * constant      - all symbols equal; stored as a single symbol
+//   * repeated      - identical to the previous column; stored as a flag
+//   * near_constant - all symbols except a few equal; stored as a symbol and the list of exceptions
+// Only regular columns are passed to the stages after gPBWT
+enum class column_kind_t : uint8_t {regular, constant, repeated, near_constant};
+
+const uint32_t NEAR_CONSTANT_MAX_EXCEPTIONS = 8;
+const uint32_t NEAR_CONSTANT_MIN_RATIO = 16;		// no. of symbols must be at least 16x larger than no. of exceptions
+
+// *******************************************************************************************
+// Descriptions of columns that are not processed by the complete pipeline
+// *******************************************************************************************
+class CColumnInfo
+{
+	vector<column_kind_t> v_kinds;
+	vector<uint8_t> v_symbols;							// for constant and near-constant columns
+	vector<uint32_t> v_exceptions_pos;					// for near-constant columns
+	vector<pair<uint32_t, uint8_t>> v_exceptions;		// (row, symbol)
+
+	size_t n_regular;
+
+	CRangeCoderModel<CVectorIOStream> *rc_kind[4];
+	CRangeCoderModel<CVectorIOStream> *rc_symbol[2];
+	CRangeCoderModel<CVectorIOStream> *rc_n_exceptions;
+	CRangeCoderModel<CVectorIOStream> *rc_same_row;
+	CRangeCoderModel<CVectorIOStream> *rc_exception_symbol;
+
+	void init_rc(CBasicRangeCoder<CVectorIOStream> *rcb, bool compress);
+	void delete_rc();
+
+	void encode_row(CRangeEncoder<CVectorIOStream> &rce, uint32_t row, uint32_t n_rows);
+	uint32_t decode_row(CRangeDecoder<CVectorIOStream> &rcd, uint32_t n_rows);
+
+public:
+	CColumnInfo();
+	~CColumnInfo();
+
+	void Clear();
+
+	void AddRegular();
+	void AddConstant(uint8_t symbol);
+	void AddRepeated();
+	void AddNearConstant(uint8_t symbol, vector<pair<uint32_t, uint8_t>> &v_col_exceptions);
+
+	size_t Size() const
+	{
+		return v_kinds.size();
+	}
+
+	size_t NoRegular() const
+	{
+		return n_regular;
+	}
+
+	column_kind_t Kind(size_t column) const
+	{
+		return v_kinds[column];
+	}
+
+	uint8_t Symbol(size_t column) const
+	{
+		return v_symbols[column];
+	}
+
+	// Exceptions of near-constant column
+	const pair<uint32_t, uint8_t> *ExceptionsBegin(size_t column) const
+	{
+		return v_exceptions.data() + v_exceptions_pos[column];
+	}
+
+	const pair<uint32_t, uint8_t> *ExceptionsEnd(size_t column) const
+	{
+		return v_exceptions.data() + v_exceptions_pos[column + 1];
+	}
+
+	void Encode(vector<uint8_t> &v_compressed, uint32_t n_rows);
+	bool Decode(vector<uint8_t> &v_compressed, uint32_t n_rows, size_t n_columns);
+};
+
+// EOF
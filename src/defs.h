@@ -29,6 +29,8 @@ using namespace std;
 
 const vector<uint8_t> GF_ID{ '#', '=', 'G', 'F', ' ', 'I', 'D' };
 const vector<uint8_t> GF_AC{ '#', '=', 'G', 'F', ' ', 'A', 'C' };
+const vector<uint8_t> GR_PREFIX{ '#', '=', 'G', 'R', ' ' };
+const vector<uint8_t> GC_PREFIX{ '#', '=', 'G', 'C', ' ' };
 
 enum class stage_mode_t {forward, reverse, copy_forward, copy_reverse};
 
@@ -78,15 +80,60 @@ public:
 		return read_pos >= v.size();
 	}
 
+	// Bytes past the end (of truncated or corrupted data) are read as zeros
 	uint8_t GetByte()
 	{
-		return v[read_pos++];
+		if (read_pos++ < v.size())
+			return v[read_pos - 1];
+
+		return 0;
+	}
+
+	// More bytes were read than stored
+	bool Overrun()
+	{
+		return read_pos > v.size();
 	}
 
 	void PutByte(uint8_t x)
 	{
 		v.push_back(x);
 	}
+
+	// Integer stored as 1 byte of length + little endian bytes
+	void PutUInt(size_t x)
+	{
+		uint8_t n_bytes = 0;
+
+		for (size_t t = x; t; ++n_bytes)
+			t >>= 8;
+
+		PutByte(n_bytes);
+
+		for (uint32_t i = 0; i < n_bytes; ++i)
+		{
+			PutByte(x & 0xff);
+			x >>= 8;
+		}
+	}
+
+	// A corrupted length is treated as the end of the stream (the result is 0 and Overrun() is set)
+	size_t GetUInt()
+	{
+		uint32_t n_bytes = GetByte();
+		size_t x = 0;
+
+		if (n_bytes > sizeof(size_t))
+		{
+			read_pos = v.size() + 1;
+			return 0;
+		}
+
+		for (uint32_t i = 0; i < n_bytes; ++i)
+			x += ((size_t) GetByte()) << (8 * i);
+
+		return x;
+	}
 };
 
 // *******************************************************************************************
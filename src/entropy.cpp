@@ -9,103 +9,203 @@
 
 #include <iostream>
 #include <unordered_map>
+#include <atomic>
 #include "entropy.h"
+#include "huffman.h"
+#include "simd.h"
 
 // *******************************************************************************************
-// Entropy coding of the columns
-void CEntropy::forward()
+// CEntropyCoder
+// *******************************************************************************************
+
+// *******************************************************************************************
+CEntropyCoder::CEntropyCoder(bool _forward_mode, ctx_length_t _ctx_length) : forward_mode(_forward_mode), ctx_length(_ctx_length), rce(nullptr), rcd(nullptr), 
+	use_run_lengths(false), encode_column(nullptr), decode_column(nullptr)
 {
-	string src;
-	uint64_t priority;
+	no_prefix_ctx = CONTEXTS[(uint8_t) ctx_length][0];
+	no_selector_ctx = CONTEXTS[(uint8_t)ctx_length][1];
+	no_suffix_ctx = CONTEXTS[(uint8_t)ctx_length][2];
+
+	create_models();
+}
+
+// *******************************************************************************************
+CEntropyCoder::~CEntropyCoder()
+{
+	delete_rc();
+	delete[] models;
+}
 
-	init_rc();
+// *******************************************************************************************
+// Create models (placed in the arena) in the order: prefix, selector, suffix
+void CEntropyCoder::create_models()
+{
+	models = new model_t[no_prefix_ctx + no_selector_ctx + no_suffix_ctx];
 
-	rce->Start();
+	size_t arena_size = no_prefix_ctx * model_t::MemorySize(4) + no_selector_ctx * model_t::MemorySize(5);
+	for (int i = 0; i < no_suffix_ctx; ++i)
+		arena_size += model_t::MemorySize(1 << (i % 8 + 1));
 
-	int ctx_prefix = no_prefix_ctx - 1;
-	int ctx_sel;
+	v_arena.resize(arena_size);
 
-	*pre_entropy_sequences_size = 0;
+	model_t *p_model = models;
+	uint32_t *p_arena = v_arena.data();
 
-	while (!in_out->IsCompleted())
+	prefix_models = models;
+	selector_models = prefix_models + no_prefix_ctx;
+	suffix_models = selector_models + no_selector_ctx;
+
+	for (int i = 0; i < no_prefix_ctx; ++i)
 	{
-		if (!in_out->Pop(priority, src))
-			continue;
+		p_model->Init(nullptr, 4, 7, 1 << 8, nullptr, forward_mode, p_arena);
+		p_arena += model_t::MemorySize(4);
+		++p_model;
+	}
 
-		ctx_sel = no_selector_ctx - 1;
-		ctx_prefix = no_prefix_ctx - 1;
+	for (int i = 0; i < no_selector_ctx; ++i)
+	{
+		p_model->Init(nullptr, 5, 7, 1 << 8, nullptr, forward_mode, p_arena);
+		p_arena += model_t::MemorySize(5);
+		++p_model;
+	}
 
-		for (auto x : src)
-		{
-			// Prefix selection: 0a(125) -> 0, 0b(126) -> 1, 1 -> 2, reszta -> 3
-			int prefix = (x == 125) ? 0 : (x == 126) ? 1 : (x == 1) ? 2 : 3;
-			//			int prefix = (x == 125) ? 0 : (x == 126) ? 1 : (x == 123) ? 2 : (x == 124) ? 3 : 4;
+	for (int i = 0; i < no_suffix_ctx; ++i)
+	{
+		p_model->Init(nullptr, 1 << (i % 8 + 1), 10, 1 << 10, nullptr, forward_mode, p_arena);
+		p_arena += model_t::MemorySize(1 << (i % 8 + 1));
+		++p_model;
+	}
+}
 
-			rc_prefix[ctx_prefix]->Encode(prefix);
-			ctx_prefix = ctx_update_prefix(ctx_prefix, prefix);
+// *******************************************************************************************
+// Start coding with fresh models
+void CEntropyCoder::Start(CVectorIOStream &vios)
+{
+	init_rc(vios);
 
-			if (prefix < 3)
-				continue;
+	if (forward_mode)
+		rce->Start();
+	else
+		rcd->Start();
+}
 
-			int selector = ilog2(x);
-			int suffix = x - (1 << (selector - 1));
+// *******************************************************************************************
+void CEntropyCoder::End()
+{
+	if (forward_mode)
+		rce->End();
+	else
+		rcd->End();
 
-			rc_selector[ctx_sel]->Encode(selector - 2);
+	delete_rc();
+}
 
-			ctx_sel = ctx_update_selector(ctx_sel, selector - 2);
+// *******************************************************************************************
+// Entropy coding of a single column
+void CEntropyCoder::EncodeColumn(const string &src)
+{
+	(this->*encode_column)(src);
+}
 
-			rc_suffix[ctx_sel % no_suffix_ctx]->Encode(suffix);
-		}
+// *******************************************************************************************
+// Entropy decoding of a single column
+size_t CEntropyCoder::DecodeColumn(string &dest, size_t column_len)
+{
+	return (this->*decode_column)(dest, column_len);
+}
 
-		*pre_entropy_sequences_size += src.size();
+// *******************************************************************************************
+// Select coding loops specialised for the context length and the coding of zero-runs
+template<ctx_length_t CTX> void CEntropyCoder::set_column_coders()
+{
+	if (use_run_lengths)
+	{
+		encode_column = &CEntropyCoder::encode_column_runs<CTX>;
+		decode_column = &CEntropyCoder::decode_column_runs<CTX>;
 	}
+	else
+	{
+		encode_column = &CEntropyCoder::encode_column_rle<CTX>;
+		decode_column = &CEntropyCoder::decode_column_rle<CTX>;
+	}
+}
 
-	rce->End();
-
-	delete_rc();
+// *******************************************************************************************
+void CEntropyCoder::select_column_coders()
+{
+	switch (ctx_length)
+	{
+	case ctx_length_t::tiny:
+		set_column_coders<ctx_length_t::tiny>();
+		break;
+	case ctx_length_t::small:
+		set_column_coders<ctx_length_t::small>();
+		break;
+	case ctx_length_t::medium:
+		set_column_coders<ctx_length_t::medium>();
+		break;
+	case ctx_length_t::large:
+		set_column_coders<ctx_length_t::large>();
+		break;
+	case ctx_length_t::huge:
+		set_column_coders<ctx_length_t::huge>();
+		break;
+	}
 }
 
 // *******************************************************************************************
-// Entropy decoding
-void CEntropy::reverse()
+// Entropy coding of a single column after RLE-0
+template<ctx_length_t CTX> void CEntropyCoder::encode_column_rle(const string &src)
 {
-	string dest;
-	uint64_t priority = 0;
+	typedef ctx_config_t<CTX> cfg;
 
-	init_rc();
+	int ctx_sel = cfg::no_selector_ctx - 1;
+	int ctx_prefix = cfg::no_prefix_ctx - 1;
 
-	rcd->Start();
+	for (auto x : src)
+	{
+		// Prefix selection: 0a(125) -> 0, 0b(126) -> 1, 1 -> 2, reszta -> 3
+		int prefix = (x == 125) ? 0 : (x == 126) ? 1 : (x == 1) ? 2 : 3;
 
-	int n_vec = 0;
-	int ctx_prefix = no_prefix_ctx - 1;
-	int ctx_sel = no_selector_ctx - 1;
+		prefix_models[ctx_prefix].Encode(prefix);
+		ctx_prefix = ctx_update_prefix<CTX>(ctx_prefix, prefix);
 
-	size_t decoded_symbols = 0;
-	size_t cur_column_decoded_symbols = 0;
+		if (prefix < 3)
+			continue;
 
-	size_t zero_run_code = 0;		// It is necessary to decode 0-runs to find the column boundary
-	size_t zero_run_code_no_bits = 0;
+		int selector = ilog2(x);
+		int suffix = x - (1 << (selector - 1));
 
-	while (decoded_symbols < *pre_entropy_sequences_size)
-	{
-		if (cur_column_decoded_symbols == n_sequences)
-		{
-			ctx_prefix = no_prefix_ctx - 1;
-			ctx_sel = no_selector_ctx - 1;
+		selector_models[ctx_sel].Encode(selector - 2);
 
-			++n_vec;
+		ctx_sel = ctx_update_selector<CTX>(ctx_sel, selector - 2);
 
-			in_out->Push(priority++, dest);
-			dest.clear();
+		suffix_models[ctx_sel % cfg::no_suffix_ctx].Encode(suffix);
+	}
+}
 
-			cur_column_decoded_symbols = 0;
-		}
-		else if (cur_column_decoded_symbols > n_sequences)
-			assert("Decoded too many\n");
+// *******************************************************************************************
+// Entropy decoding of a single column after RLE-0
+// It is necessary to decode 0-runs to find the column boundary
+template<ctx_length_t CTX> size_t CEntropyCoder::decode_column_rle(string &dest, size_t column_len)
+{
+	typedef ctx_config_t<CTX> cfg;
+
+	int ctx_prefix = cfg::no_prefix_ctx - 1;
+	int ctx_sel = cfg::no_selector_ctx - 1;
 
-		int prefix = rc_prefix[ctx_prefix]->Decode();
+	size_t cur_column_decoded_symbols = 0;
+
+	size_t zero_run_code = 0;
+	size_t zero_run_code_no_bits = 0;
 
-		ctx_prefix = ctx_update_prefix(ctx_prefix, prefix);
+	dest.clear();
+
+	while (cur_column_decoded_symbols < column_len)
+	{
+		int prefix = prefix_models[ctx_prefix].Decode();
+
+		ctx_prefix = ctx_update_prefix<CTX>(ctx_prefix, prefix);
 		int x;
 
 		if (prefix > 1 && zero_run_code_no_bits)		// In case of 0-run we need to add its length
@@ -136,10 +236,10 @@ void CEntropy::reverse()
 
 				++zero_run_code_no_bits;
 				zero_run_code += prefix << (zero_run_code_no_bits - 1);
-				
+
 				size_t zero_run_len = zero_run_code + (1ull << zero_run_code_no_bits) - 1;
 
-				if (cur_column_decoded_symbols + zero_run_len == n_sequences)
+				if (cur_column_decoded_symbols + zero_run_len == column_len)
 				{
 					cur_column_decoded_symbols += zero_run_len;
 					zero_run_code = 0;
@@ -149,72 +249,239 @@ void CEntropy::reverse()
 		}
 		else
 		{
-			int selector = rc_selector[ctx_sel]->Decode() + 2;
-			ctx_sel = ctx_update_selector(ctx_sel, selector - 2);
+			int selector = selector_models[ctx_sel].Decode() + 2;
+			ctx_sel = ctx_update_selector<CTX>(ctx_sel, selector - 2);
 
-			int suffix = rc_suffix[ctx_sel % no_suffix_ctx]->Decode();
+			int suffix = suffix_models[ctx_sel % cfg::no_suffix_ctx].Decode();
 
 			x = suffix + (1 << (selector - 1));
-			
+
 			++cur_column_decoded_symbols;
 		}
 
 		dest.push_back(x);
-		++decoded_symbols;
 	}
 
-	in_out->Push(priority, dest);
+	if (cur_column_decoded_symbols > column_len)
+		assert("Decoded too many\n");
 
-	rcd->End();
+	return dest.size();
+}
 
-	delete_rc();
+// *******************************************************************************************
+// Code length of zero-run (max_len - no. of symbols to the column end).
+// Runs to the column end are just flagged. Other lengths are Elias-gamma binarised: no. of bits
+// (in unary) in the context of the previous run, the highest bits in the context of no. of bits,
+// the remaining bits are almost random.
+void CEntropyCoder::encode_run(uint32_t len, uint32_t max_len, int &ctx_run, int prev_symbol)
+{
+	int ctx = ctx_run * 3 + prev_symbol;
 
-	in_out->MarkCompleted();
+	encode_bit(run_to_end[ctx], len == max_len);
+	if (len == max_len)
+		return;
+
+	int no_bits = ilog2(len) - 1;
+	int max_no_bits = ilog2(max_len - 1) - 1;
+
+	for (int i = 0; i < no_bits; ++i)
+		encode_bit(run_no_bits[ctx][i], 1);
+	if (no_bits < max_no_bits)
+		encode_bit(run_no_bits[ctx][no_bits], 0);
+
+	int node = 1;
+	for (int i = no_bits - 1; i >= 0; --i)
+	{
+		uint32_t bit = (len >> i) & 1;
+
+		if (node < (1 << RUN_NO_MODELLED_BITS))
+		{
+			encode_bit(run_bits[no_bits][node], bit);
+			node = node * 2 + bit;
+		}
+		else
+			rce->EncodeBit(bit, 1u << (RC_BIT_PROB_BITS - 1));
+	}
+
+	ctx_run = 1 + min(no_bits, RUN_NO_LEN_CTX - 2);
 }
 
 // *******************************************************************************************
-// Do processing
-void CEntropy::operator()()
+uint32_t CEntropyCoder::decode_run(uint32_t max_len, int &ctx_run, int prev_symbol)
 {
-	if (forward_mode)
-		forward();
-	else
-		reverse();
+	int ctx = ctx_run * 3 + prev_symbol;
+
+	if (decode_bit(run_to_end[ctx]))
+		return max_len;
+
+	int no_bits = 0;
+	int max_no_bits = ilog2(max_len - 1) - 1;
+
+	while (no_bits < max_no_bits && decode_bit(run_no_bits[ctx][no_bits]))
+		++no_bits;
+
+	uint32_t len = 1;
+	int node = 1;
+	for (int i = no_bits - 1; i >= 0; --i)
+	{
+		uint32_t bit;
+
+		if (node < (1 << RUN_NO_MODELLED_BITS))
+		{
+			bit = decode_bit(run_bits[no_bits][node]);
+			node = node * 2 + bit;
+		}
+		else
+			bit = rcd->DecodeBit(1u << (RC_BIT_PROB_BITS - 1));
+
+		len = len * 2 + bit;
+	}
+
+	ctx_run = 1 + min(no_bits, RUN_NO_LEN_CTX - 2);
+
+	// Only corrupted data can give a longer run than the rest of the column
+	return min(len, max_len);
+}
+
+// *******************************************************************************************
+// Entropy coding of a single column before RLE-0
+template<ctx_length_t CTX> void CEntropyCoder::encode_column_runs(const string &src)
+{
+	typedef ctx_config_t<CTX> cfg;
+
+	int ctx_sel = cfg::no_selector_ctx - 1;
+	int ctx_prefix = cfg::no_prefix_ctx - 1;
+	int ctx_run = 0;
+	int prev_symbol = 0;
+
+	const uint8_t *p = (const uint8_t *) src.data();
+	size_t n = src.size();
+
+	for (size_t i = 0; i < n; )
+	{
+		int x = p[i];
+
+		if (x == 0)
+		{
+			// Zero-runs are long after WFC/MTF, so their ends are found by SIMD kernel
+			size_t len = find_first_not_of(p + i, n - i, 0);
+
+			prefix_models[ctx_prefix].Encode(0);
+			encode_run((uint32_t) len, (uint32_t) (n - i), ctx_run, prev_symbol);
+			ctx_prefix = ctx_update_prefix<CTX>(ctx_prefix, len >= RUN_LONG_THR);
+
+			i += len;
+			continue;
+		}
+
+		++i;
+
+		int prefix = (x == 1) ? 2 : 3;
+
+		prefix_models[ctx_prefix].Encode(prefix);
+		ctx_prefix = ctx_update_prefix<CTX>(ctx_prefix, prefix);
+		prev_symbol = prefix - 1;
+
+		if (prefix < 3)
+			continue;
+
+		int selector = ilog2(x);
+		int suffix = x - (1 << (selector - 1));
+
+		selector_models[ctx_sel].Encode(selector - 2);
+		ctx_sel = ctx_update_selector<CTX>(ctx_sel, selector - 2);
+
+		suffix_models[ctx_sel % cfg::no_suffix_ctx].Encode(suffix);
+	}
+}
+
+// *******************************************************************************************
+// Entropy decoding of a single column before RLE-0
+template<ctx_length_t CTX> size_t CEntropyCoder::decode_column_runs(string &dest, size_t column_len)
+{
+	typedef ctx_config_t<CTX> cfg;
+
+	int ctx_prefix = cfg::no_prefix_ctx - 1;
+	int ctx_sel = cfg::no_selector_ctx - 1;
+	int ctx_run = 0;
+	int prev_symbol = 0;
+
+	dest.clear();
+
+	while (dest.size() < column_len)
+	{
+		int prefix = prefix_models[ctx_prefix].Decode();
+
+		if (prefix == 0)
+		{
+			uint32_t len = decode_run((uint32_t) (column_len - dest.size()), ctx_run, prev_symbol);
+			dest.append(len, 0);
+			ctx_prefix = ctx_update_prefix<CTX>(ctx_prefix, len >= RUN_LONG_THR);
+			continue;
+		}
+
+		ctx_prefix = ctx_update_prefix<CTX>(ctx_prefix, prefix);
+		prev_symbol = prefix - 1;
+
+		if (prefix == 3)
+		{
+			int selector = selector_models[ctx_sel].Decode() + 2;
+			ctx_sel = ctx_update_selector<CTX>(ctx_sel, selector - 2);
+
+			int suffix = suffix_models[ctx_sel % cfg::no_suffix_ctx].Decode();
+
+			dest.push_back((char) (suffix + (1 << (selector - 1))));
+		}
+		else
+			dest.push_back(1);
+	}
+
+	return dest.size();
 }
 
 // *******************************************************************************************
 // Initialize range coder classes
-void CEntropy::init_rc()
+void CEntropyCoder::init_rc(CVectorIOStream &vios)
 {
 	CBasicRangeCoder<CVectorIOStream> *rcb;
 
+	delete_rc();
+
 	if (forward_mode)
 	{
-		rce = new CRangeEncoder<CVectorIOStream>(*vios);
-		rcd = nullptr;		
+		rce = new CRangeEncoder<CVectorIOStream>(vios);
+		rcd = nullptr;
 		rcb = (CBasicRangeCoder<CVectorIOStream> *) rce;
 	}
 	else
 	{
-		rce = nullptr;		
-		rcd = new CRangeDecoder<CVectorIOStream>(*vios);
+		rce = nullptr;
+		rcd = new CRangeDecoder<CVectorIOStream>(vios);
 		rcb = (CBasicRangeCoder<CVectorIOStream> *) rcd;
 	}
-	
-	// Initialize models
-	for (int i = 0; i < no_prefix_ctx; ++i)
-		rc_prefix[i] = new CRangeCoderModel<CVectorIOStream>(rcb, 4, 7, 1 << 8, nullptr, forward_mode);
 
-	for (int i = 0; i < no_selector_ctx; ++i)
-		rc_selector[i] = new CRangeCoderModel<CVectorIOStream>(rcb, 5, 7, 1 << 8, nullptr, forward_mode);
+	// Reset models in place
+	for (int i = 0; i < no_prefix_ctx + no_selector_ctx + no_suffix_ctx; ++i)
+		models[i].Reset(rcb);
 
-	for (int i = 0; i < no_suffix_ctx; ++i)
-		rc_suffix[i] = new CRangeCoderModel<CVectorIOStream>(rcb, 1 << (i % 8 + 1), 10, 1 << 10, nullptr, forward_mode);
+	select_column_coders();
+
+	if (use_run_lengths)
+	{
+		for (auto &x : run_to_end)
+			x.Reset();
+		for (auto &x : run_no_bits)
+			for (auto &y : x)
+				y.Reset();
+		for (auto &x : run_bits)
+			for (auto &y : x)
+				y.Reset();
+	}
 }
 
 // *******************************************************************************************
-// Delete range coder classes and models
-void CEntropy::delete_rc()
+// Delete range coder classes (models are kept for the next stream)
+void CEntropyCoder::delete_rc()
 {
 	if (rce)
 		delete rce;
@@ -223,39 +490,482 @@ void CEntropy::delete_rc()
 	if (rcd)
 		delete rcd;
 	rcd = nullptr;
-	
-	for (int i = 0; i < no_prefix_ctx; ++i)
+}
+
+// *******************************************************************************************
+// Int log2
+int CEntropyCoder::ilog2(int x)
+{
+	int r;
+
+	for (r = 0; x; ++r)
+		x >>= 1;
+
+	return r;
+}
+
+
+// *******************************************************************************************
+// CEntropyCoderPool
+// *******************************************************************************************
+
+// *******************************************************************************************
+CEntropyCoderPool::~CEntropyCoderPool()
+{
+	for (auto &x : v_free)
+		delete x.coder;
+}
+
+// *******************************************************************************************
+CEntropyCoderBase *CEntropyCoderPool::Create(entropy_backend_t backend, ctx_length_t ctx_length, bool forward)
+{
+	if (backend == entropy_backend_t::huffman)
+		return new CEntropyCoderHuffman(forward);
+	else
+		return new CEntropyCoder(forward, ctx_length);
+}
+
+// *******************************************************************************************
+// Take a free coder of given kind or create a new one
+CEntropyCoderBase *CEntropyCoderPool::Acquire(entropy_backend_t backend, ctx_length_t ctx_length, bool forward)
+{
 	{
-		if (rc_prefix[i])
-			delete rc_prefix[i];
-		rc_prefix[i] = nullptr;
+		lock_guard<mutex> lck(mtx);
+
+		for (size_t i = 0; i < v_free.size(); ++i)
+			if (v_free[i].backend == backend && v_free[i].ctx_length == ctx_length && v_free[i].forward == forward)
+			{
+				CEntropyCoderBase *coder = v_free[i].coder;
+				v_free[i] = v_free.back();
+				v_free.pop_back();
+
+				return coder;
+			}
 	}
-	
-	for (int i = 0; i < no_selector_ctx; ++i)
+
+	return Create(backend, ctx_length, forward);
+}
+
+// *******************************************************************************************
+void CEntropyCoderPool::Release(entropy_backend_t backend, ctx_length_t ctx_length, bool forward, CEntropyCoderBase *coder)
+{
+	lock_guard<mutex> lck(mtx);
+
+	v_free.push_back(item_t{backend, ctx_length, forward, coder});
+}
+
+
+// *******************************************************************************************
+// CEntropy
+// *******************************************************************************************
+
+// *******************************************************************************************
+CEntropyCoderBase *CEntropy::create_coder(bool forward, entropy_backend_t _backend, ctx_length_t _ctx_length)
+{
+	CEntropyCoderBase *coder;
+
+	if (coder_pool)
+		coder = coder_pool->Acquire(_backend, _ctx_length, forward);
+	else
+		coder = CEntropyCoderPool::Create(_backend, _ctx_length, forward);
+
+	if (!coder->SetRunLengths(run_lengths))
+		throw "Entropy coder does not support coding of zero-runs";
+
+	return coder;
+}
+
+// *******************************************************************************************
+void CEntropy::release_coder(bool forward, entropy_backend_t _backend, ctx_length_t _ctx_length, CEntropyCoderBase *coder)
+{
+	if (coder_pool)
+		coder_pool->Release(_backend, _ctx_length, forward, coder);
+	else
+		delete coder;
+}
+
+// *******************************************************************************************
+// No. of symbols of the column seen by the entropy coder (for filling the blocks)
+size_t CEntropy::no_coded_symbols(const string &column)
+{
+	if (!run_lengths)
+		return column.size();
+
+	size_t r = 0;
+	uint8_t prev = 1;
+
+	for (auto c : column)
 	{
-		if (rc_selector[i])
-			delete rc_selector[i];
-		rc_selector[i] = nullptr;
+		r += c != 0 || prev != 0;
+		prev = (uint8_t) c;
 	}
-	
-	for (int i = 0; i < no_suffix_ctx; ++i)
+
+	return r;
+}
+
+// *******************************************************************************************
+// Take the next column to code (from the buffer if the columns were read for the selection of context lengths)
+bool CEntropy::pop_column(string &column)
+{
+	uint64_t priority;
+
+	if (select_ctx)
 	{
-		if(rc_suffix[i])
-			delete rc_suffix[i];
-		rc_suffix[i] = nullptr;
+		if (buffered_pos == v_buffered.size())
+			return false;
+
+		column = move(v_buffered[buffered_pos++]);
+
+		return true;
 	}
+
+	while (!in_out->IsCompleted())
+		if (in_out->Pop(priority, column))
+			return true;
+
+	return false;
 }
 
 // *******************************************************************************************
-// Int log2
-int CEntropy::ilog2(int x)
+// Select context lengths giving the smallest output. All columns are read and (a sample of) them
+// is coded with each candidate (in parallel). For large streams (or blocks) the sizes are
+// extrapolated from the rate of models after learning the sample.
+// Range coder is used for trials of all backends (they share the models).
+void CEntropy::select_ctx_length()
 {
-	int r;
+	string column;
+	uint64_t priority;
+	size_t n_symbols = 0;
 
-	for (r = 0; x; ++r)
-		x >>= 1;
+	while (!in_out->IsCompleted())
+		if (in_out->Pop(priority, column))
+		{
+			n_symbols += no_coded_symbols(column);
+			v_buffered.emplace_back(move(column));
+		}
 
-	return r;
+	if (v_buffered.empty())
+		return;
+
+	// In the block mode the models learn only within a block
+	size_t n_stream_symbols = block_size ? min(n_symbols, block_size) : n_symbols;
+	size_t sample_size = min(CTX_TRIAL_SAMPLE_SIZE, n_stream_symbols);
+
+	// Sample of contiguous chunks of columns (neighbouring columns are similar, so their order is kept)
+	vector<const string *> v_sample;
+	size_t n_sample_symbols = 0;
+	size_t n_columns = v_buffered.size();
+
+	if (n_symbols <= sample_size)
+		for (auto &x : v_buffered)
+			v_sample.push_back(&x);
+	else
+	{
+		size_t chunk_len = max<size_t>(1, (size_t) ((double) n_columns * sample_size / n_symbols / CTX_TRIAL_NO_CHUNKS));
+
+		for (size_t i = 0; i < CTX_TRIAL_NO_CHUNKS; ++i)
+		{
+			size_t first = (2 * i + 1) * n_columns / (2 * CTX_TRIAL_NO_CHUNKS);
+			first -= min(first, chunk_len / 2);
+
+			for (size_t j = first; j < min(first + chunk_len, n_columns); ++j)
+				v_sample.push_back(&v_buffered[j]);
+		}
+	}
+
+	for (auto x : v_sample)
+		n_sample_symbols += no_coded_symbols(*x);
+
+	// The sample is coded twice, so its second copy shows the rate of the models after learning
+	bool extrapolate = n_sample_symbols < n_stream_symbols && n_sample_symbols > 0;
+
+	vector<double> v_est_size(NO_CTX_LENGTHS);
+	atomic<int> next_candidate(0);
+
+	vector<thread> v_thr;
+	for (int i = 0; i < min(n_threads, NO_CTX_LENGTHS); ++i)
+		v_thr.emplace_back([&] {
+			vector<uint8_t> v_data;
+
+			for (int j = next_candidate++; j < NO_CTX_LENGTHS; j = next_candidate++)
+			{
+				CEntropyCoderBase *coder = create_coder(true, entropy_backend_t::range_coder, (ctx_length_t) j);
+
+				v_data.clear();
+				CVectorIOStream trial_vios(v_data);
+
+				coder->Start(trial_vios);
+				for (auto x : v_sample)
+					coder->EncodeColumn(*x);
+				size_t cold_size = v_data.size();
+				if (extrapolate)
+					for (auto x : v_sample)
+						coder->EncodeColumn(*x);
+				coder->End();
+
+				release_coder(true, entropy_backend_t::range_coder, (ctx_length_t) j, coder);
+
+				v_est_size[j] = (double) cold_size;
+				if (extrapolate)
+					v_est_size[j] += (double) (v_data.size() - cold_size) * (n_stream_symbols - n_sample_symbols) / n_sample_symbols;
+			}
+		});
+
+	for (auto &x : v_thr)
+		x.join();
+
+	// Ties are resolved in favour of the requested context lengths
+	int best = (int) ctx_length;
+	for (int i = 0; i < NO_CTX_LENGTHS; ++i)
+		if (v_est_size[i] < v_est_size[best])
+			best = i;
+
+	ctx_length = (ctx_length_t) best;
+}
+
+// *******************************************************************************************
+// Entropy coding of the columns
+void CEntropy::forward()
+{
+	string src;
+
+	CEntropyCoderBase *coder = create_coder(true, backend, ctx_length);
+
+	coder->Start(*vios);
+
+	*pre_entropy_sequences_size = 0;
+
+	while (pop_column(src))
+	{
+		coder->EncodeColumn(src);
+
+		*pre_entropy_sequences_size += src.size();
+	}
+
+	coder->End();
+	release_coder(true, backend, ctx_length, coder);
+}
+
+// *******************************************************************************************
+// Entropy decoding
+void CEntropy::reverse()
+{
+	string dest;
+	uint64_t priority = 0;
+
+	CEntropyCoderBase *coder = create_coder(false, backend, ctx_length);
+
+	coder->Start(*vios);
+
+	size_t decoded_symbols = 0;
+
+	while (decoded_symbols < *pre_entropy_sequences_size)
+	{
+		decoded_symbols += coder->DecodeColumn(dest, column_len(priority));
+		in_out->Push(priority++, dest);
+	}
+
+	coder->End();
+	release_coder(false, backend, ctx_length, coder);
+
+	in_out->MarkCompleted();
+}
+
+// *******************************************************************************************
+// Entropy coding of the columns in independent blocks
+void CEntropy::forward_blocks()
+{
+	string src;
+
+	vector<block_t *> v_blocks;
+	CRegisteringPriorityQueue<block_t *> q_blocks(1);
+
+	// Workers coding blocks
+	vector<thread> v_thr;
+	for (int i = 0; i < n_threads; ++i)
+		v_thr.emplace_back([&] {
+			CEntropyCoderBase *coder = create_coder(true, backend, ctx_length);
+			block_t *block;
+			uint64_t block_priority;
+
+			while (!q_blocks.IsCompleted())
+			{
+				if (!q_blocks.Pop(block_priority, block))
+					continue;
+
+				CVectorIOStream block_vios(block->v_data);
+
+				coder->Start(block_vios);
+				for (auto &x : block->v_columns)
+					coder->EncodeColumn(x);
+				coder->End();
+
+				vector<string>().swap(block->v_columns);
+			}
+
+			release_coder(true, backend, ctx_length, coder);
+		});
+
+	block_t *block = nullptr;
+	size_t n_columns = 0;
+
+	*pre_entropy_sequences_size = 0;
+
+	while (pop_column(src))
+	{
+		if (!block)
+		{
+			block = new block_t;
+			block->first_column = n_columns;
+			block->n_columns = 0;
+			block->n_symbols = 0;
+			block->n_coded_symbols = 0;
+		}
+
+		block->n_symbols += src.size();
+		block->n_coded_symbols += no_coded_symbols(src);
+		++block->n_columns;
+		++n_columns;
+		*pre_entropy_sequences_size += src.size();
+		block->v_columns.emplace_back(move(src));
+
+		if (block->n_coded_symbols >= block_size)
+		{
+			q_blocks.Push(v_blocks.size(), block);
+			v_blocks.push_back(block);
+			block = nullptr;
+		}
+	}
+
+	if (block)
+	{
+		q_blocks.Push(v_blocks.size(), block);
+		v_blocks.push_back(block);
+	}
+
+	q_blocks.MarkCompleted();
+
+	for (auto &x : v_thr)
+		x.join();
+
+	// Index of blocks followed by their data
+	vios->PutUInt(v_blocks.size());
+	for (auto x : v_blocks)
+	{
+		vios->PutUInt(x->v_data.size());
+		vios->PutUInt(x->n_columns);
+		vios->PutUInt(x->n_symbols);
+	}
+
+	for (auto x : v_blocks)
+	{
+		for (auto c : x->v_data)
+			vios->PutByte(c);
+		delete x;
+	}
+}
+
+// *******************************************************************************************
+// Entropy decoding of independent blocks
+void CEntropy::reverse_blocks()
+{
+	size_t n_blocks = vios->GetUInt();
+	size_t n_columns = 0;
+	size_t n_symbols = 0;
+
+	// Each block contains at least one symbol
+	if (n_blocks > max(*pre_entropy_sequences_size, (size_t) 1))
+	{
+		corrupted = true;
+		in_out->MarkCompleted();
+		return;
+	}
+
+	vector<block_t *> v_blocks(n_blocks);
+
+	for (auto &x : v_blocks)
+	{
+		x = new block_t;
+		x->v_data.resize(vios->GetUInt());
+		x->first_column = n_columns;
+		x->n_columns = vios->GetUInt();
+		x->n_symbols = vios->GetUInt();
+		x->n_decoded_symbols = 0;
+
+		n_columns += x->n_columns;
+		n_symbols += x->n_symbols;
+	}
+
+	// The index must agree with the sizes given outside the stream
+	if (n_symbols != *pre_entropy_sequences_size || (v_column_lengths && n_columns != v_column_lengths->size()))
+	{
+		for (auto x : v_blocks)
+			delete x;
+
+		corrupted = true;
+		in_out->MarkCompleted();
+		return;
+	}
+
+	for (auto x : v_blocks)
+		for (auto &c : x->v_data)
+			c = vios->GetByte();
+
+	atomic<size_t> next_block(0);
+
+	vector<thread> v_thr;
+	for (int i = 0; i < n_threads; ++i)
+		v_thr.emplace_back([&] {
+			CEntropyCoderBase *coder = create_coder(false, backend, ctx_length);
+			string dest;
+
+			for (size_t j = next_block++; j < n_blocks; j = next_block++)
+			{
+				block_t *block = v_blocks[j];
+				CVectorIOStream block_vios(block->v_data);
+
+				coder->Start(block_vios);
+				for (size_t k = 0; k < block->n_columns; ++k)
+				{
+					block->n_decoded_symbols += coder->DecodeColumn(dest, column_len(block->first_column + k));
+					in_out->Push(block->first_column + k, dest);
+				}
+				coder->End();
+
+				vector<uint8_t>().swap(block->v_data);
+			}
+
+			release_coder(false, backend, ctx_length, coder);
+		});
+
+	for (auto &x : v_thr)
+		x.join();
+
+	for (auto x : v_blocks)
+	{
+		if (x->n_decoded_symbols != x->n_symbols)
+			corrupted = true;
+		delete x;
+	}
+
+	in_out->MarkCompleted();
+}
+
+// *******************************************************************************************
+// Do processing
+void CEntropy::operator()()
+{
+	if (forward_mode && select_ctx)
+		select_ctx_length();
+
+	if (forward_mode && block_size)
+		forward_blocks();
+	else if (forward_mode)
+		forward();
+	else if (block_size)
+		reverse_blocks();
+	else
+		reverse();
 }
 
 // *******************************************************************************************
@@ -279,18 +989,4 @@ double CEntropy::calc_avg_entropy(string &s)
 	return ent;
 }
 
-// *******************************************************************************************
-// Update selector context
-uint32_t CEntropy::ctx_update_selector(uint32_t old, uint32_t selector)
-{
-	return ((old << 3) + selector) % no_selector_ctx;
-}
-
-// *******************************************************************************************
-// Update prefix context
-uint32_t CEntropy::ctx_update_prefix(uint32_t old, uint32_t prefix)
-{
-	return (old * 5 + prefix) % no_prefix_ctx;
-}
-
 // EOF
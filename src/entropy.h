@@ -9,6 +9,7 @@
 // *******************************************************************************************
 
 #include <vector>
+#include <mutex>
 #include "defs.h"
 #include "queue.h"
 #include "rc.h"
@@ -28,8 +29,9 @@ const int MAX_NO_SELECTOR_CTX = c_pow(8, 3);
 const int MAX_NO_SUFFIX_CTX = c_pow(8, 2);
 
 enum class ctx_length_t {tiny, small, medium, large, huge};
+const int NO_CTX_LENGTHS = 5;
 
-const int CONTEXTS[5][3] = { 
+constexpr int CONTEXTS[NO_CTX_LENGTHS][3] = { 
 	{c_pow(5, 2), c_pow(8, 1), c_pow(8, 1)},
 	{c_pow(5, 3), c_pow(8, 2), c_pow(8, 1)},
 	{c_pow(5, 4), c_pow(8, 2), c_pow(8, 2)},
@@ -37,59 +39,276 @@ const int CONTEXTS[5][3] = {
 	{c_pow(5, 5), c_pow(8, 3), c_pow(8, 2)}
 };
 
+// Sizes of contexts known at compile time (for coding loops specialised for the context length)
+template<ctx_length_t CTX> struct ctx_config_t
+{
+	static const int no_prefix_ctx = CONTEXTS[(int) CTX][0];
+	static const int no_selector_ctx = CONTEXTS[(int) CTX][1];
+	static const int no_suffix_ctx = CONTEXTS[(int) CTX][2];
+};
+
+const size_t ENTROPY_BLOCK_SIZE = 1 << 20;			// default no. of symbols in independently coded blocks
+
+// Selection of context lengths by trial coding
+const size_t CTX_TRIAL_SAMPLE_SIZE = 1 << 22;		// no. of symbols in the sample of columns coded with each candidate
+const size_t CTX_TRIAL_NO_CHUNKS = 8;				// no. of evenly spaced chunks of columns in the sample
+
+// Zero-runs coded directly (in place of RLE-0 digits)
+const int RUN_NO_LEN_CTX = 18;						// no previous run in the column, no. of bits of the previous run (0..15, 16+)
+const int RUN_NO_CTX = RUN_NO_LEN_CTX * 3;			// ... and the previous symbol: none (column start), 1, other
+const int RUN_MAX_BITS = 32;
+const uint32_t RUN_LONG_THR = 4;					// runs of at least this length are seen as prefix 1 in the contexts of prefixes
+const int RUN_NO_MODELLED_BITS = 3;					// the highest bits of lengths (below the leading 1) coded by adaptive models
+
+enum class entropy_backend_t {range_coder, huffman};
+
+// Configuration of the entropy coding stage
+struct entropy_params_t {
+	ctx_length_t ctx_length;
+	size_t block_size;								// 0 - single stream
+	entropy_backend_t backend;
+	bool run_lengths;								// columns come before RLE-0 (zero-runs are coded by the entropy coder)
+	bool select_ctx;								// context lengths are selected by trial coding of (a sample of) columns
+
+	entropy_params_t() : ctx_length(ctx_length_t::tiny), block_size(0), backend(entropy_backend_t::range_coder), run_lengths(false), select_ctx(false)
+	{};
+};
+
 // *******************************************************************************************
-//
+// Interface of entropy coders of columns
 // *******************************************************************************************
-class CEntropy
+class CEntropyCoderBase
 {
-	CRegisteringPriorityQueue<string> *in_out;
-	CVectorIOStream *vios;
+public:
+	virtual ~CEntropyCoderBase()
+	{};
+
+	virtual void Start(CVectorIOStream &vios) = 0;
+	virtual void End() = 0;
+
+	virtual void EncodeColumn(const string &src) = 0;
+
+	// Decode column of column_len symbols (before RLE-0 decoding). Returns no. of decoded symbols.
+	virtual size_t DecodeColumn(string &dest, size_t column_len) = 0;
+
+	// Code columns before RLE-0, with lengths of zero-runs coded directly (from the next Start()).
+	// Returns false if not supported by the coder.
+	virtual bool SetRunLengths(bool _use_run_lengths)
+	{
+		return !_use_run_lengths;
+	};
+};
+
+// *******************************************************************************************
+// Models and contexts for entropy coding of columns
+// *******************************************************************************************
+class CEntropyCoder : public CEntropyCoderBase
+{
+	typedef CRangeCoderModel<CVectorIOStream> model_t;
+
 	bool forward_mode;
-	size_t *pre_entropy_sequences_size;
-	size_t n_sequences;
 	ctx_length_t ctx_length;
 
 	CRangeEncoder<CVectorIOStream> *rce;
 	CRangeDecoder<CVectorIOStream> *rcd;
-	CRangeCoderModel<CVectorIOStream>
-		*rc_prefix[MAX_NO_PREFIX_CTX],
-		*rc_selector[MAX_NO_SELECTOR_CTX],
-		*rc_suffix[MAX_NO_SUFFIX_CTX];
+
+	// All models are kept in a single array with statistics in a single arena; they are
+	// created once and reset in place for each coded stream
+	model_t *models;
+	vector<uint32_t> v_arena;
+
+	// Models of zero-run lengths: flag of a run to the column end, unary coded no. of bits of length, highest bits of length
+	bool use_run_lengths;
+	CBitModel run_to_end[RUN_NO_CTX];
+	CBitModel run_no_bits[RUN_NO_CTX][RUN_MAX_BITS];
+	CBitModel run_bits[RUN_MAX_BITS][1 << RUN_NO_MODELLED_BITS];
+
+	model_t
+		*prefix_models,
+		*selector_models,
+		*suffix_models;
 
 	int no_prefix_ctx;
 	int no_selector_ctx;
 	int no_suffix_ctx;
 
+	void create_models();
+	void init_rc(CVectorIOStream &vios);
+	void delete_rc();
+
+	int ilog2(int x);
+
+	void encode_bit(CBitModel &model, uint32_t bit)
+	{
+		rce->EncodeBit(bit, model.GetProb0());
+		model.Update(bit);
+	}
+
+	uint32_t decode_bit(CBitModel &model)
+	{
+		uint32_t bit = rcd->DecodeBit(model.GetProb0());
+		model.Update(bit);
+
+		return bit;
+	}
+
+	void encode_run(uint32_t len, uint32_t max_len, int &ctx_run, int prev_symbol);
+	uint32_t decode_run(uint32_t max_len, int &ctx_run, int prev_symbol);
+
+	// Coding loops specialised for the context length; selected once per stream (at Start())
+	void (CEntropyCoder::*encode_column)(const string &src);
+	size_t (CEntropyCoder::*decode_column)(string &dest, size_t column_len);
+
+	template<ctx_length_t CTX> void set_column_coders();
+	void select_column_coders();
+
+	template<ctx_length_t CTX> void encode_column_rle(const string &src);
+	template<ctx_length_t CTX> size_t decode_column_rle(string &dest, size_t column_len);
+	template<ctx_length_t CTX> void encode_column_runs(const string &src);
+	template<ctx_length_t CTX> size_t decode_column_runs(string &dest, size_t column_len);
+
+	// Moduli are constant, so they are folded by the compiler
+	template<ctx_length_t CTX> static uint32_t ctx_update_selector(uint32_t old, uint32_t selector)
+	{
+		return ((old << 3) + selector) % ctx_config_t<CTX>::no_selector_ctx;
+	}
+
+	template<ctx_length_t CTX> static uint32_t ctx_update_prefix(uint32_t old, uint32_t prefix)
+	{
+		return (old * 5 + prefix) % ctx_config_t<CTX>::no_prefix_ctx;
+	}
+
+public:
+	CEntropyCoder(bool _forward_mode, ctx_length_t _ctx_length);
+	~CEntropyCoder();
+
+	void Start(CVectorIOStream &vios);
+	void End();
+
+	bool SetRunLengths(bool _use_run_lengths)
+	{
+		use_run_lengths = _use_run_lengths;
+
+		return true;
+	}
+
+	void EncodeColumn(const string &src);
+	size_t DecodeColumn(string &dest, size_t column_len);
+};
+
+// *******************************************************************************************
+// Pool of entropy coders reused by consecutive families (and trials), so the models are not
+// allocated for each of them
+// *******************************************************************************************
+class CEntropyCoderPool
+{
+	struct item_t {
+		entropy_backend_t backend;
+		ctx_length_t ctx_length;
+		bool forward;
+		CEntropyCoderBase *coder;
+	};
+
+	mutex mtx;
+	vector<item_t> v_free;
+
+public:
+	CEntropyCoderPool()
+	{};
+
+	~CEntropyCoderPool();
+
+	static CEntropyCoderBase *Create(entropy_backend_t backend, ctx_length_t ctx_length, bool forward);
+
+	CEntropyCoderBase *Acquire(entropy_backend_t backend, ctx_length_t ctx_length, bool forward);
+	void Release(entropy_backend_t backend, ctx_length_t ctx_length, bool forward, CEntropyCoderBase *coder);
+};
+
+// *******************************************************************************************
+// Entropy coding stage
+// In the block mode the columns are grouped into blocks coded independently (with fresh models)
+// by several threads. The stream starts with the index of blocks.
+// *******************************************************************************************
+class CEntropy
+{
+	// Block of columns coded independently
+	struct block_t {
+		vector<string> v_columns;
+		vector<uint8_t> v_data;
+		size_t first_column;
+		size_t n_columns;
+		size_t n_symbols;
+		size_t n_coded_symbols;						// zero-runs count as single symbols if coded directly
+		size_t n_decoded_symbols;
+	};
+
+	CRegisteringPriorityQueue<string> *in_out;
+	CVectorIOStream *vios;
+	bool forward_mode;
+	size_t *pre_entropy_sequences_size;
+	size_t n_sequences;
+	const vector<uint32_t> *v_column_lengths;		// if not given, all columns are of n_sequences length
+	ctx_length_t ctx_length;
+	size_t block_size;								// 0 - single stream
+	int n_threads;
+	entropy_backend_t backend;
+	CEntropyCoderPool *coder_pool;					// if not given, coders are created for each stream
+	bool run_lengths;								// columns come before RLE-0 (zero-runs are coded by the entropy coder)
+	bool select_ctx;								// context lengths are selected by trial coding of (a sample of) columns
+
+	// Columns read from the input queue before the coding (for the selection of context lengths)
+	vector<string> v_buffered;
+	size_t buffered_pos;
+
+	bool corrupted;
+
 	void forward();
 	void reverse();
+	void forward_blocks();
+	void reverse_blocks();
 
-	void init_rc();
-	void delete_rc();
+	size_t column_len(size_t column)
+	{
+		return v_column_lengths ? (*v_column_lengths)[column] : n_sequences;
+	}
 
-	int ilog2(int x);
-	double calc_avg_entropy(string &s);
+	size_t no_coded_symbols(const string &column);
+
+	bool pop_column(string &column);
+	void select_ctx_length();
+
+	CEntropyCoderBase *create_coder(bool forward, entropy_backend_t _backend, ctx_length_t _ctx_length);
+	void release_coder(bool forward, entropy_backend_t _backend, ctx_length_t _ctx_length, CEntropyCoderBase *coder);
 
-	uint32_t ctx_update_selector(uint32_t old, uint32_t selector);
-	uint32_t ctx_update_prefix(uint32_t old, uint32_t prefix);
+	double calc_avg_entropy(string &s);
 
 public:
-	CEntropy(CRegisteringPriorityQueue<string> *_in_out, CVectorIOStream *_vios, size_t &pre_entropy_sequences_size, size_t _n_sequences, bool _forward_mode, ctx_length_t _ctx_length) :
-		in_out(_in_out), vios(_vios), forward_mode(_forward_mode), pre_entropy_sequences_size(&pre_entropy_sequences_size), n_sequences(_n_sequences), ctx_length(_ctx_length), rce(nullptr), rcd(nullptr)
+	CEntropy(CRegisteringPriorityQueue<string> *_in_out, CVectorIOStream *_vios, size_t &pre_entropy_sequences_size, size_t _n_sequences, bool _forward_mode, 
+		const entropy_params_t &params, int _n_threads = 1, const vector<uint32_t> *_v_column_lengths = nullptr, CEntropyCoderPool *_coder_pool = nullptr) :
+		in_out(_in_out), vios(_vios), forward_mode(_forward_mode), pre_entropy_sequences_size(&pre_entropy_sequences_size), n_sequences(_n_sequences), 
+		v_column_lengths(_v_column_lengths), ctx_length(params.ctx_length), block_size(params.block_size), n_threads(_n_threads), backend(params.backend), coder_pool(_coder_pool), 
+		run_lengths(params.run_lengths), select_ctx(params.select_ctx), buffered_pos(0), corrupted(false)
 	{
 		if (!in_out || !vios)
 			throw "No I/O queues";
 
-		no_prefix_ctx = CONTEXTS[(uint8_t) ctx_length][0];
-		no_selector_ctx = CONTEXTS[(uint8_t)ctx_length][1];
-		no_suffix_ctx = CONTEXTS[(uint8_t)ctx_length][2];
+		if (n_threads < 1)
+			n_threads = 1;
 	};
 
-	~CEntropy()
+	void operator()();
+
+	// Context lengths used for coding (can differ from the requested ones if they are selected by trial)
+	ctx_length_t GetCtxLength() const
 	{
-		delete_rc();
+		return ctx_length;
 	}
 
-	void operator()();
+	// True if the index of blocks does not match the decoded data
+	bool IsCorrupted() const
+	{
+		return corrupted;
+	}
 };
 
 // EOF
@@ -0,0 +1,253 @@
+// *******************************************************************************************
+// This file is a part of CoMSA software distributed under GNU GPL 3 licence.
+// The homepage of the CoMSA project is http://sun.aei.polsl.pl/REFRESH/CoMSA
+//
+// Author : Sebastian Deorowicz
+// Version: 1.2
+// Date   : 2018-10-04
+// *******************************************************************************************
+
+#include <algorithm>
+#include "gap_mask.h"
+#include "simd.h"
+
+// *******************************************************************************************
+//
+CGapMask::CGapMask()
+{
+	fill_n(rc_class, GAP_MASK_NO_CLASSES + 1, nullptr);
+	fill_n(rc_len_bits, GAP_MASK_NO_CLASSES, nullptr);
+
+	Clear();
+}
+
+// *******************************************************************************************
+//
+CGapMask::~CGapMask()
+{
+	delete_rc();
+}
+
+// *******************************************************************************************
+void CGapMask::Clear()
+{
+	v_classes.clear();
+	v_lengths.clear();
+	v_n_residues.clear();
+	v_runs_pos.clear();
+	v_runs_pos.push_back(0);
+}
+
+// *******************************************************************************************
+void CGapMask::add_run(uint8_t c, uint32_t len)
+{
+	v_classes.push_back(c);
+	v_lengths.push_back(len);
+}
+
+// *******************************************************************************************
+// Gap runs are long after gPBWT, so their ends are found by SIMD kernel
+void CGapMask::AddColumn(const string &column, string &residues)
+{
+	const uint8_t *p = (const uint8_t *) column.data();
+	size_t n = column.size();
+
+	residues.clear();
+
+	for (size_t i = 0; i < n; )
+	{
+		uint8_t c = symbol_class(p[i]);
+		size_t len;
+
+		if (c)
+			len = find_first_not_of(p + i, n - i, p[i]);
+		else
+		{
+			for (len = 1; i + len < n && symbol_class(p[i + len]) == 0; ++len)
+				;
+			residues.append(column, i, len);
+		}
+
+		add_run(c, (uint32_t) len);
+		i += len;
+	}
+
+	v_runs_pos.push_back((uint32_t) v_classes.size());
+	v_n_residues.push_back((uint32_t) residues.size());
+}
+
+// *******************************************************************************************
+void CGapMask::ExpandColumn(size_t column, const string &residues, string &dest) const
+{
+	size_t pos = 0;
+	size_t res_pos = 0;
+
+	for (uint32_t i = v_runs_pos[column]; i < v_runs_pos[column + 1]; ++i)
+	{
+		uint32_t len = v_lengths[i];
+
+		if (v_classes[i] == 0)
+		{
+			copy_n(residues.begin() + res_pos, len, dest.begin() + pos);
+			res_pos += len;
+		}
+		else
+			fill_n(dest.begin() + pos, len, v_classes[i] == 1 ? '-' : '.');
+
+		pos += len;
+	}
+}
+
+// *******************************************************************************************
+// Initialize range coder models
+void CGapMask::init_rc(CBasicRangeCoder<CVectorIOStream> *rcb, bool compress)
+{
+	delete_rc();
+
+	for (auto &x : rc_class)
+		x = new CRangeCoderModel<CVectorIOStream>(rcb, GAP_MASK_NO_CLASSES, 10, 1 << 10, nullptr, compress);
+	for (auto &x : rc_len_bits)
+		x = new CRangeCoderModel<CVectorIOStream>(rcb, GAP_MASK_MAX_LEN_BITS, 12, 1 << 12, nullptr, compress);
+}
+
+// *******************************************************************************************
+// Delete range coder models
+void CGapMask::delete_rc()
+{
+	for (auto &x : rc_class)
+	{
+		delete x;
+		x = nullptr;
+	}
+
+	for (auto &x : rc_len_bits)
+	{
+		delete x;
+		x = nullptr;
+	}
+}
+
+// *******************************************************************************************
+// Run length is coded as the no. of its bits followed by the bits (except the leading one)
+void CGapMask::encode_len(CRangeEncoder<CVectorIOStream> &rce, int c, uint32_t len)
+{
+	int n_bits = 0;
+	for (uint32_t t = len; t; t >>= 1)
+		++n_bits;
+
+	rc_len_bits[c]->Encode(n_bits);
+
+	uint32_t low = len - (1u << (n_bits - 1));
+	int low_bits = n_bits - 1;
+
+	if (low_bits > 16)
+	{
+		rce.EncodeFrequency(1, low >> 16, 1u << (low_bits - 16));
+		low &= 0xffff;
+		low_bits = 16;
+	}
+
+	rce.EncodeFrequency(1, low, 1u << low_bits);
+}
+
+// *******************************************************************************************
+uint32_t CGapMask::decode_len(CRangeDecoder<CVectorIOStream> &rcd, int c)
+{
+	int n_bits = rc_len_bits[c]->Decode();
+	if (n_bits == 0)
+		return 0;			// corrupted data
+
+	uint32_t len = 1u << (n_bits - 1);
+	int low_bits = n_bits - 1;
+
+	if (low_bits > 16)
+	{
+		uint32_t tot = 1u << (low_bits - 16);
+		uint32_t hi = rcd.GetCumulativeFreq(tot);
+		rcd.UpdateFrequency(1, hi, tot);
+		len += hi << 16;
+		low_bits = 16;
+	}
+
+	uint32_t tot = 1u << low_bits;
+	uint32_t lo = rcd.GetCumulativeFreq(tot);
+	rcd.UpdateFrequency(1, lo, tot);
+
+	return len + lo;
+}
+
+// *******************************************************************************************
+// Encode gap mask. The class of the first run of a column is coded in a separate context.
+void CGapMask::Encode(vector<uint8_t> &v_compressed)
+{
+	v_compressed.clear();
+
+	CVectorIOStream vios(v_compressed);
+	CRangeEncoder<CVectorIOStream> rce(vios);
+
+	init_rc(&rce, true);
+	rce.Start();
+
+	for (size_t i = 0; i < Size(); ++i)
+	{
+		int ctx = GAP_MASK_NO_CLASSES;
+
+		for (uint32_t j = v_runs_pos[i]; j < v_runs_pos[i + 1]; ++j)
+		{
+			rc_class[ctx]->Encode(v_classes[j]);
+			encode_len(rce, v_classes[j], v_lengths[j]);
+			ctx = v_classes[j];
+		}
+	}
+
+	rce.End();
+	delete_rc();
+}
+
+// *******************************************************************************************
+// Decode gap mask. Returns false for corrupted data.
+bool CGapMask::Decode(vector<uint8_t> &v_compressed, uint32_t n_rows, size_t n_columns)
+{
+	Clear();
+
+	CVectorIOStream vios(v_compressed);
+	CRangeDecoder<CVectorIOStream> rcd(vios);
+
+	init_rc(&rcd, false);
+	rcd.Start();
+
+	for (size_t i = 0; i < n_columns; ++i)
+	{
+		int ctx = GAP_MASK_NO_CLASSES;
+		uint32_t n_residues = 0;
+
+		for (uint32_t pos = 0; pos < n_rows; )
+		{
+			uint8_t c = (uint8_t) rc_class[ctx]->Decode();
+			uint32_t len = decode_len(rcd, c);
+
+			if (len == 0 || len > n_rows - pos)
+			{
+				delete_rc();
+				return false;
+			}
+
+			add_run(c, len);
+			if (c == 0)
+				n_residues += len;
+
+			pos += len;
+			ctx = c;
+		}
+
+		v_runs_pos.push_back((uint32_t) v_classes.size());
+		v_n_residues.push_back(n_residues);
+	}
+
+	rcd.End();
+	delete_rc();
+
+	return !vios.Overrun();
+}
+
+// EOF
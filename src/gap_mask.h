@@ -0,0 +1,78 @@
+#pragma once
+// *******************************************************************************************
+// This file is a part of CoMSA software distributed under GNU GPL 3 licence.
+// The homepage of the CoMSA project is http://sun.aei.polsl.pl/REFRESH/CoMSA
+//
+// Author : Sebastian Deorowicz
+// Version: 1.2
+// Date   : 2018-10-04
+// *******************************************************************************************
+
+#include <vector>
+#include <string>
+#include "defs.h"
+#include "rc.h"
+
+using namespace std;
+
+// Classes of symbols in the gap mask
+//   * 0 - residue
+//   * 1 - '-' (deletion in match state)
+//   * 2 - '.' (no insertion in insert state)
+const int GAP_MASK_NO_CLASSES = 3;
+const int GAP_MASK_MAX_LEN_BITS = 33;
+
+// *******************************************************************************************
+// Positions of gaps in the columns after gPBWT stored as runs of symbol classes.
+// Only the residues of the columns are processed by the stages after gPBWT.
+// *******************************************************************************************
+class CGapMask
+{
+	vector<uint8_t> v_classes;
+	vector<uint32_t> v_lengths;
+	vector<uint32_t> v_runs_pos;				// first run of column
+	vector<uint32_t> v_n_residues;
+
+	CRangeCoderModel<CVectorIOStream> *rc_class[GAP_MASK_NO_CLASSES + 1];
+	CRangeCoderModel<CVectorIOStream> *rc_len_bits[GAP_MASK_NO_CLASSES];
+
+	void init_rc(CBasicRangeCoder<CVectorIOStream> *rcb, bool compress);
+	void delete_rc();
+
+	void add_run(uint8_t c, uint32_t len);
+
+	void encode_len(CRangeEncoder<CVectorIOStream> &rce, int c, uint32_t len);
+	uint32_t decode_len(CRangeDecoder<CVectorIOStream> &rcd, int c);
+
+	static inline uint8_t symbol_class(uint8_t x)
+	{
+		return x == '-' ? 1 : x == '.' ? 2 : 0;
+	}
+
+public:
+	CGapMask();
+	~CGapMask();
+
+	void Clear();
+
+	// Register column (after gPBWT) and extract residues from it
+	void AddColumn(const string &column, string &residues);
+
+	// Restore column from its residues
+	void ExpandColumn(size_t column, const string &residues, string &dest) const;
+
+	size_t Size() const
+	{
+		return v_n_residues.size();
+	}
+
+	uint32_t NoResidues(size_t column) const
+	{
+		return v_n_residues[column];
+	}
+
+	void Encode(vector<uint8_t> &v_compressed);
+	bool Decode(vector<uint8_t> &v_compressed, uint32_t n_rows, size_t n_columns);
+};
+
+// EOF
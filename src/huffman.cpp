@@ -0,0 +1,380 @@
+// *******************************************************************************************
+// This file is a part of CoMSA software distributed under GNU GPL 3 licence.
+// The homepage of the CoMSA project is http://sun.aei.polsl.pl/REFRESH/CoMSA
+//
+// Author : Sebastian Deorowicz
+// Version: 1.2
+// Date   : 2018-10-04
+// *******************************************************************************************
+
+#include <algorithm>
+#include <cstring>
+#include "huffman.h"
+
+// *******************************************************************************************
+CEntropyCoderHuffman::CEntropyCoderHuffman(bool _forward_mode) : forward_mode(_forward_mode), vios(nullptr), bit_pos(0)
+{
+}
+
+// *******************************************************************************************
+CEntropyCoderHuffman::~CEntropyCoderHuffman()
+{
+}
+
+// *******************************************************************************************
+// Encoder: clear the buffers; decoder: read code lengths and the bit stream of the block
+void CEntropyCoderHuffman::Start(CVectorIOStream &_vios)
+{
+	vios = &_vios;
+
+	v_lengths.assign(HUFFMAN_NO_CTX * HUFFMAN_NO_SYMBOLS, 0);
+	v_codes.assign(HUFFMAN_NO_CTX * HUFFMAN_NO_SYMBOLS, 0);
+
+	if (forward_mode)
+	{
+		v_symbols.clear();
+		v_column_sizes.clear();
+		v_counts.assign(HUFFMAN_NO_CTX * HUFFMAN_NO_SYMBOLS, 0);
+		return;
+	}
+
+	for (int ctx = 0; ctx < HUFFMAN_NO_CTX; ++ctx)
+	{
+		if (!vios->GetByte())
+			continue;
+
+		uint8_t *lengths = v_lengths.data() + ctx * HUFFMAN_NO_SYMBOLS;
+		for (int i = 0; i < HUFFMAN_NO_SYMBOLS; i += 2)
+		{
+			uint8_t x = vios->GetByte();
+			lengths[i] = x & 0xf;
+			lengths[i + 1] = x >> 4;
+		}
+	}
+
+	size_t n_bytes = 0;
+	for (int i = 0; i < 4; ++i)
+		n_bytes += ((size_t) vios->GetByte()) << (8 * i);
+
+	// Padding allows to read 8 bytes at any position of the stream
+	v_bits.resize(n_bytes + 8);
+	for (size_t i = 0; i < n_bytes; ++i)
+		v_bits[i] = vios->GetByte();
+	fill(v_bits.begin() + n_bytes, v_bits.end(), 0);
+
+	bit_pos = 0;
+
+	build_tables();
+}
+
+// *******************************************************************************************
+void CEntropyCoderHuffman::End()
+{
+	if (forward_mode)
+		encode_block();
+
+	vector<uint8_t>().swap(v_symbols);
+	vector<uint32_t>().swap(v_column_sizes);
+	vector<uint8_t>().swap(v_bits);
+	vector<uint8_t>().swap(v_out);
+	vios = nullptr;
+}
+
+// *******************************************************************************************
+// Columns are only buffered; they are coded in End() when the statistics are known
+void CEntropyCoderHuffman::EncodeColumn(const string &src)
+{
+	int ctx = HUFFMAN_NO_CTX - 1;
+
+	for (auto c : src)
+	{
+		uint8_t x = (uint8_t) c;
+
+		++v_counts[ctx * HUFFMAN_NO_SYMBOLS + x];
+		ctx = ctx_update(ctx, symbol_class(x));
+	}
+
+	v_symbols.insert(v_symbols.end(), src.begin(), src.end());
+	v_column_sizes.push_back((uint32_t) src.size());
+}
+
+// *******************************************************************************************
+// Decoding of a single column
+// It is necessary to decode 0-runs to find the column boundary
+size_t CEntropyCoderHuffman::DecodeColumn(string &dest, size_t column_len)
+{
+	const uint32_t mask = (1u << HUFFMAN_MAX_CODE_LEN) - 1;
+	const entry_t *table = v_table.data();
+	const uint8_t *bits = v_bits.data();
+
+	// Position of the padding - past the end of the stream (of truncated or corrupted data) only zeros are read
+	const size_t max_pos = (v_bits.size() - 8) * 8;
+
+	// Local copies of the state (stores to the output could alias the members)
+	size_t pos = bit_pos;
+	int ctx = HUFFMAN_NO_CTX - 1;
+
+	// Length of the current 0-run (bijective base-2 digits 125, 126) is accumulated without branches
+	size_t cur_column_decoded_symbols = 0;
+	size_t zero_run_len = 0;
+	size_t zero_run_no_digits = 0;
+
+	// RLE-0 does not expand the data, so column_len is the upper bound of no. of decoded symbols
+	if (v_out.size() < column_len + 1)
+		v_out.resize(column_len + 1);
+	uint8_t *out = v_out.data();
+	size_t n_out = 0;
+
+	// Update the counters if take is all ones
+	auto process_symbol = [&](uint8_t x, size_t take) {
+		size_t digit_mask = (size_t) 0 - (size_t) (x >= 125);
+		size_t keep = ~take;
+
+		cur_column_decoded_symbols += (zero_run_len + 1) & ~digit_mask & take;
+		zero_run_len = (((zero_run_len + ((size_t) (2 - (x & 1)) << zero_run_no_digits)) & digit_mask) & take) | (zero_run_len & keep);
+		zero_run_no_digits = (((zero_run_no_digits + 1) & digit_mask) & take) | (zero_run_no_digits & keep);
+
+		out[n_out] = x;
+		n_out += take & 1;
+	};
+
+	while (cur_column_decoded_symbols + zero_run_len < column_len)
+	{
+		uint64_t word;
+		memcpy(&word, bits + (min(pos, max_pos) >> 3), 8);
+
+		entry_t e = table[(ctx << HUFFMAN_MAX_CODE_LEN) + ((word >> (pos & 7)) & mask)];
+
+		pos += (e >> 14) & 0xf;
+		process_symbol((uint8_t) (e & 0x7f), ~(size_t) 0);
+
+		// The second symbol is used only if the column is not completed by the first one
+		uint32_t len2 = (e >> 18) & 0xf;
+		size_t take2 = (size_t) 0 - (size_t) (len2 != 0 && cur_column_decoded_symbols + zero_run_len < column_len);
+
+		pos += len2 & take2;
+		process_symbol((uint8_t) ((e >> 7) & 0x7f), take2);
+
+		ctx = (int) (e >> 22);
+	}
+
+	bit_pos = pos;
+	dest.assign((char *) out, n_out);
+
+	return n_out;
+}
+
+// *******************************************************************************************
+// Determine lengths of Huffman codes limited to HUFFMAN_MAX_CODE_LEN bits.
+// If the codes are too long, the counts are halved and the codes are rebuilt.
+void CEntropyCoderHuffman::build_lengths(const uint32_t *counts, uint8_t *lengths)
+{
+	vector<uint32_t> v_cnt(counts, counts + HUFFMAN_NO_SYMBOLS);
+	vector<int> v_used;
+
+	fill_n(lengths, HUFFMAN_NO_SYMBOLS, 0);
+
+	for (int i = 0; i < HUFFMAN_NO_SYMBOLS; ++i)
+		if (v_cnt[i])
+			v_used.push_back(i);
+
+	if (v_used.empty())
+		return;
+
+	if (v_used.size() == 1)
+	{
+		lengths[v_used.front()] = 1;
+		return;
+	}
+
+	while (true)
+	{
+		// Nodes: leaves [0, n) and internal nodes [n, 2n-1)
+		size_t n = v_used.size();
+		vector<pair<uint64_t, int>> v_heap;
+		vector<int> v_parent(2 * n - 1, -1);
+
+		for (size_t i = 0; i < n; ++i)
+			v_heap.emplace_back(v_cnt[v_used[i]], (int) i);
+
+		auto cmp = [](const pair<uint64_t, int> &a, const pair<uint64_t, int> &b) {
+			return a > b;
+		};
+		make_heap(v_heap.begin(), v_heap.end(), cmp);
+
+		for (int node = (int) n; v_heap.size() > 1; ++node)
+		{
+			pop_heap(v_heap.begin(), v_heap.end(), cmp);
+			auto a = v_heap.back();
+			v_heap.pop_back();
+			pop_heap(v_heap.begin(), v_heap.end(), cmp);
+			auto b = v_heap.back();
+			v_heap.pop_back();
+
+			v_parent[a.second] = node;
+			v_parent[b.second] = node;
+			v_heap.emplace_back(a.first + b.first, node);
+			push_heap(v_heap.begin(), v_heap.end(), cmp);
+		}
+
+		// Parents have larger indices than their children
+		vector<int> v_depth(2 * n - 1, 0);
+		for (int i = (int) (2 * n - 3); i >= 0; --i)
+			v_depth[i] = v_depth[v_parent[i]] + 1;
+
+		int max_len = 0;
+		for (size_t i = 0; i < n; ++i)
+			max_len = max(max_len, v_depth[i]);
+
+		if (max_len <= HUFFMAN_MAX_CODE_LEN)
+		{
+			for (size_t i = 0; i < n; ++i)
+				lengths[v_used[i]] = (uint8_t) v_depth[i];
+			return;
+		}
+
+		for (auto i : v_used)
+			v_cnt[i] = (v_cnt[i] + 1) / 2;
+	}
+}
+
+// *******************************************************************************************
+// Assign canonical codes; the codes are bit reversed, as the stream is read from the LSB
+void CEntropyCoderHuffman::build_codes(const uint8_t *lengths, uint16_t *codes)
+{
+	uint32_t len_counts[HUFFMAN_MAX_CODE_LEN + 1] = { 0 };
+	uint32_t next_code[HUFFMAN_MAX_CODE_LEN + 1] = { 0 };
+
+	for (int i = 0; i < HUFFMAN_NO_SYMBOLS; ++i)
+		++len_counts[lengths[i]];
+	len_counts[0] = 0;
+
+	for (int len = 1; len <= HUFFMAN_MAX_CODE_LEN; ++len)
+		next_code[len] = (next_code[len - 1] + len_counts[len - 1]) << 1;
+
+	for (int i = 0; i < HUFFMAN_NO_SYMBOLS; ++i)
+	{
+		int len = lengths[i];
+		if (!len)
+			continue;
+
+		uint32_t code = next_code[len]++;
+		uint32_t rev = 0;
+		for (int j = 0; j < len; ++j)
+			rev |= ((code >> j) & 1) << (len - 1 - j);
+
+		codes[i] = (uint16_t) rev;
+	}
+}
+
+// *******************************************************************************************
+// Build decoding tables: for each context and each HUFFMAN_MAX_CODE_LEN-bit lookahead the
+// first symbol and (if its code fits in the remaining bits) the second one
+void CEntropyCoderHuffman::build_tables()
+{
+	const uint32_t table_size = 1u << HUFFMAN_MAX_CODE_LEN;
+
+	// Single-symbol tables: symbol (7 bits), length (4 bits)
+	// Unused lookaheads (possible only for a context with a single symbol) are filled with 1-bit codes
+	vector<uint16_t> v_single(HUFFMAN_NO_CTX * table_size, 1 << 7);
+
+	for (int ctx = 0; ctx < HUFFMAN_NO_CTX; ++ctx)
+	{
+		uint8_t *lengths = v_lengths.data() + ctx * HUFFMAN_NO_SYMBOLS;
+		uint16_t *codes = v_codes.data() + ctx * HUFFMAN_NO_SYMBOLS;
+		uint16_t *single = v_single.data() + ctx * table_size;
+
+		build_codes(lengths, codes);
+
+		for (int i = 0; i < HUFFMAN_NO_SYMBOLS; ++i)
+			if (lengths[i])
+				for (uint32_t j = codes[i]; j < table_size; j += 1u << lengths[i])
+					single[j] = (uint16_t) (i + (lengths[i] << 7));
+	}
+
+	v_table.resize(HUFFMAN_NO_CTX * table_size);
+
+	for (int ctx = 0; ctx < HUFFMAN_NO_CTX; ++ctx)
+		for (uint32_t j = 0; j < table_size; ++j)
+		{
+			uint32_t s1 = v_single[ctx * table_size + j];
+			uint32_t sym1 = s1 & 0x7f;
+			uint32_t len1 = s1 >> 7;
+
+			int ctx2 = ctx_update(ctx, symbol_class((uint8_t) sym1));
+			entry_t e = sym1 + (len1 << 14) + ((entry_t) ctx2 << 22);
+
+			uint32_t s2 = v_single[ctx2 * table_size + (j >> len1)];
+			uint32_t sym2 = s2 & 0x7f;
+			uint32_t len2 = s2 >> 7;
+
+			if (len1 + len2 <= (uint32_t) HUFFMAN_MAX_CODE_LEN && v_lengths[ctx2 * HUFFMAN_NO_SYMBOLS + sym2] == len2)
+				e = sym1 + (sym2 << 7) + (len1 << 14) + (len2 << 18) + ((entry_t) ctx_update(ctx2, symbol_class((uint8_t) sym2)) << 22);
+
+			v_table[ctx * table_size + j] = e;
+		}
+}
+
+// *******************************************************************************************
+// Store code lengths and the bit stream of the buffered block
+void CEntropyCoderHuffman::encode_block()
+{
+	for (int ctx = 0; ctx < HUFFMAN_NO_CTX; ++ctx)
+	{
+		build_lengths(v_counts.data() + ctx * HUFFMAN_NO_SYMBOLS, v_lengths.data() + ctx * HUFFMAN_NO_SYMBOLS);
+		build_codes(v_lengths.data() + ctx * HUFFMAN_NO_SYMBOLS, v_codes.data() + ctx * HUFFMAN_NO_SYMBOLS);
+	}
+
+	// Code lengths (4 bits each) of used contexts
+	for (int ctx = 0; ctx < HUFFMAN_NO_CTX; ++ctx)
+	{
+		uint8_t *lengths = v_lengths.data() + ctx * HUFFMAN_NO_SYMBOLS;
+		bool used = any_of(lengths, lengths + HUFFMAN_NO_SYMBOLS, [](uint8_t x) {return x != 0; });
+
+		vios->PutByte(used);
+		if (used)
+			for (int i = 0; i < HUFFMAN_NO_SYMBOLS; i += 2)
+				vios->PutByte(lengths[i] + (lengths[i + 1] << 4));
+	}
+
+	// Bit stream
+	vector<uint8_t> v_out;
+	v_out.reserve(v_symbols.size() / 2);
+
+	uint64_t acc = 0;
+	uint32_t n_acc = 0;
+	size_t pos = 0;
+
+	for (auto size : v_column_sizes)
+	{
+		int ctx = HUFFMAN_NO_CTX - 1;
+
+		for (uint32_t i = 0; i < size; ++i)
+		{
+			uint8_t x = v_symbols[pos++];
+			uint32_t idx = ctx * HUFFMAN_NO_SYMBOLS + x;
+
+			acc |= (uint64_t) v_codes[idx] << n_acc;
+			n_acc += v_lengths[idx];
+
+			for (; n_acc >= 8; n_acc -= 8)
+			{
+				v_out.push_back((uint8_t) acc);
+				acc >>= 8;
+			}
+
+			ctx = ctx_update(ctx, symbol_class(x));
+		}
+	}
+
+	if (n_acc)
+		v_out.push_back((uint8_t) acc);
+
+	for (int i = 0; i < 4; ++i)
+		vios->PutByte((uint8_t) (v_out.size() >> (8 * i)));
+
+	for (auto x : v_out)
+		vios->PutByte(x);
+}
+
+// EOF
@@ -0,0 +1,83 @@
+#pragma once
+// *******************************************************************************************
+// This file is a part of CoMSA software distributed under GNU GPL 3 licence.
+// The homepage of the CoMSA project is http://sun.aei.polsl.pl/REFRESH/CoMSA
+//
+// Author : Sebastian Deorowicz
+// Version: 1.2
+// Date   : 2018-10-04
+// *******************************************************************************************
+
+#include <vector>
+#include <string>
+#include "defs.h"
+#include "entropy.h"
+
+using namespace std;
+
+const int HUFFMAN_NO_SYMBOLS = 128;
+const int HUFFMAN_MAX_CODE_LEN = 12;				// also no. of bits of decoding tables
+const int HUFFMAN_CTX_ORDER = 2;					// no. of previous symbol classes in the context
+const int HUFFMAN_NO_CTX = c_pow(4, HUFFMAN_CTX_ORDER);
+
+static_assert(HUFFMAN_NO_CTX <= 16, "Context must fit in 4 bits of decoding table entries");
+
+// *******************************************************************************************
+// Static (per block) canonical Huffman coder of columns for fast decompression.
+// Symbols are coded in contexts of the classes of previous symbols (0-run digits, 1, others).
+// The encoder buffers the block and stores the code lengths before the bit stream.
+// The decoder resolves up to two symbols with a single lookup in a table of
+// 2^HUFFMAN_MAX_CODE_LEN entries.
+// *******************************************************************************************
+class CEntropyCoderHuffman : public CEntropyCoderBase
+{
+	// Decoding table entry: symbol 1 (7 bits), symbol 2 (7 bits), length of symbol 1 (4 bits),
+	// length of symbol 2 (4 bits; 0 if there is a single symbol), context after the symbols (4 bits)
+	typedef uint32_t entry_t;
+
+	bool forward_mode;
+	CVectorIOStream *vios;
+
+	// Encoder
+	vector<uint8_t> v_symbols;
+	vector<uint32_t> v_column_sizes;
+	vector<uint32_t> v_counts;						// [ctx][symbol]
+
+	// Code lengths and codes (bit reversed) for [ctx][symbol]
+	vector<uint8_t> v_lengths;
+	vector<uint16_t> v_codes;
+
+	// Decoder
+	vector<uint8_t> v_bits;
+	size_t bit_pos;
+	vector<entry_t> v_table;						// [ctx][2^HUFFMAN_MAX_CODE_LEN]
+	vector<uint8_t> v_out;							// decoded symbols of a column
+
+	static int symbol_class(uint8_t x)
+	{
+		return x == 125 ? 0 : x == 126 ? 1 : x == 1 ? 2 : 3;
+	}
+
+	static int ctx_update(int ctx, int sym_class)
+	{
+		return (ctx * 4 + sym_class) % HUFFMAN_NO_CTX;
+	}
+
+	void build_lengths(const uint32_t *counts, uint8_t *lengths);
+	void build_codes(const uint8_t *lengths, uint16_t *codes);
+	void build_tables();
+
+	void encode_block();
+
+public:
+	CEntropyCoderHuffman(bool _forward_mode);
+	~CEntropyCoderHuffman();
+
+	void Start(CVectorIOStream &_vios);
+	void End();
+
+	void EncodeColumn(const string &src);
+	size_t DecodeColumn(string &dest, size_t column_len);
+};
+
+// EOF
@@ -11,7 +11,9 @@
 
 #include "lzma_wrapper.h"
 #include <algorithm>
+#include <cstring>
 #include <iostream>
+#include <unordered_set>
 
 // *******************************************************************************************
 // Do processing
@@ -30,35 +32,126 @@ void CLZMAWrapper::forward()
 	if (v_text->empty())
 		return;
 
-	lzma_stream strm = LZMA_STREAM_INIT;
+	lzma_stream local_strm = LZMA_STREAM_INIT;
+	lzma_stream *strm = streams ? &streams->encoder : &local_strm;
+	uint8_t dict_size_log;
+
+	success = init_encoder(strm, compression_mode, v_text->size(), dict_size_log);
+
+	// Raw LZMA2 stream does not contain the dictionary size necessary for the decoder nor any check of the data
+	if (success && v_dictionary)
+	{
+		uint32_t crc = lzma_crc32(v_text->data(), v_text->size(), 0);
+
+		v_text_compressed->push_back(dict_size_log);
+		for (int i = 0; i < 4; ++i, crc >>= 8)
+			v_text_compressed->push_back((uint8_t) crc);
+	}
 
-	bool success = init_encoder(&strm, compression_mode);
 	if (success)
-		success = compress(&strm, *v_text, *v_text_compressed);
+		success = compress(strm, *v_text, *v_text_compressed);
 
-	lzma_end(&strm);
+	// Kept streams are released only after errors (the next initialisation starts from scratch)
+	if (strm == &local_strm || !success)
+		lzma_end(strm);
 }
 
 // *******************************************************************************************
 // Run LZMA decompression
 void CLZMAWrapper::reverse()
 {
-	lzma_stream strm = LZMA_STREAM_INIT;
-
-	bool success;
+	if (v_text_compressed->empty())
+		return;
 
-	success = init_decoder(&strm);
-	if(success)
-		success = decompress(&strm, *v_text_compressed, *v_text);
+	lzma_stream local_strm = LZMA_STREAM_INIT;
+	lzma_stream *strm = streams ? &streams->decoder : &local_strm;
+
+	if (v_dictionary)
+	{
+		auto &v_in = *v_text_compressed;
+		size_t text_start = v_text->size();
+
+		success = v_in.size() > LZMA_RAW_HEADER_SIZE && init_decoder(strm, v_in[0]);
+		if (success)
+			success = decompress(strm, v_in, LZMA_RAW_HEADER_SIZE, 0, *v_text);
+		if (success)
+		{
+			uint32_t crc = (uint32_t) v_in[1] + ((uint32_t) v_in[2] << 8) + ((uint32_t) v_in[3] << 16) + ((uint32_t) v_in[4] << 24);
+			success = crc == lzma_crc32(v_text->data() + text_start, v_text->size() - text_start, 0);
+		}
+	}
+	else
+	{
+		success = init_decoder(strm, 0);
+		if (success)
+			success = decompress(strm, *v_text_compressed, 0, stored_uncompressed_size(*v_text_compressed), *v_text);
+	}
 
-	lzma_end(&strm);
+	if (strm == &local_strm || !success)
+		lzma_end(strm);
 }
 
 // *******************************************************************************************
 // Initialize LZMA coder
-bool CLZMAWrapper::init_encoder(lzma_stream *strm, uint32_t preset)
+// Large texts are split into blocks compressed in parallel (decoded by the usual xz decoder).
+// With the preset dictionary, the text is compressed by a single thread as raw LZMA2 stream.
+// The settings of the preset are used, but the dictionary is not much larger than the text (block).
+// A larger one does not improve compression, while its match finder (hundreds of MB for preset 9) 
+// must be allocated and cleared for every family. The margin keeps the hash tables of the match 
+// finder (sized from the dictionary) large enough to find the same matches as the full preset.
+bool CLZMAWrapper::init_encoder(lzma_stream *strm, uint32_t preset, size_t text_size, uint8_t &dict_size_log)
 {
-	lzma_ret ret = lzma_easy_encoder(strm, preset, LZMA_CHECK_CRC64);
+	lzma_options_lzma opt_lzma;
+
+	if (lzma_lzma_preset(&opt_lzma, preset))
+	{
+		cerr << "Some bug in LZMA stage\n";
+		return false;
+	}
+
+	bool multithreaded = n_threads > 1 && text_size >= LZMA_MT_MIN_SIZE && !v_dictionary;
+	size_t block_size = text_size;
+
+	if (multithreaded)
+		block_size = max(LZMA_MT_MIN_BLOCK_SIZE, (text_size + n_threads - 1) / n_threads);
+	if (v_dictionary)
+	{
+		block_size += v_dictionary->size();
+		opt_lzma.preset_dict = v_dictionary->data();
+		opt_lzma.preset_dict_size = (uint32_t) v_dictionary->size();
+	}
+
+	uint32_t dict_size = LZMA_DICT_SIZE_MIN;
+	while (dict_size < 8 * block_size && dict_size < opt_lzma.dict_size)
+		dict_size <<= 1;
+	opt_lzma.dict_size = std::min(dict_size, opt_lzma.dict_size);
+
+	for (dict_size_log = 0; (1u << dict_size_log) < opt_lzma.dict_size; ++dict_size_log)
+		;
+
+	lzma_filter filters[] = {
+		{ LZMA_FILTER_LZMA2, &opt_lzma },
+		{ LZMA_VLI_UNKNOWN, NULL }
+	};
+
+	lzma_ret ret;
+
+	if (multithreaded)
+	{
+		lzma_mt opt_mt;
+
+		memset(&opt_mt, 0, sizeof(opt_mt));
+		opt_mt.threads = (uint32_t) n_threads;
+		opt_mt.block_size = block_size;
+		opt_mt.filters = filters;
+		opt_mt.check = LZMA_CHECK_CRC64;
+
+		ret = lzma_stream_encoder_mt(strm, &opt_mt);
+	}
+	else if (v_dictionary)
+		ret = lzma_raw_encoder(strm, filters);
+	else
+		ret = lzma_stream_encoder(strm, filters, LZMA_CHECK_CRC64);
 
 	if (ret == LZMA_OK)
 		return true;
@@ -69,63 +162,106 @@ bool CLZMAWrapper::init_encoder(lzma_stream *strm, uint32_t preset)
 }
 
 // *******************************************************************************************
-// Do actual compression
+// Do actual compression - the whole input is given to LZMA at once and the output is written 
+// directly to the vector (sized from the bound of the compressed size)
 bool CLZMAWrapper::compress(lzma_stream *strm, vector<uint8_t> &v_in, vector<uint8_t> &v_out)
 {
-	lzma_action action = LZMA_RUN;
+	size_t out_start = v_out.size();
 
-	uint8_t inbuf[BUFSIZ];
-	uint8_t outbuf[BUFSIZ];
+	v_out.resize(out_start + lzma_stream_buffer_bound(v_in.size()));
 
-	strm->next_in = NULL;
-	strm->avail_in = 0;
-	strm->next_out = outbuf;
-	strm->avail_out = sizeof(outbuf);
-
-	size_t in_size = v_in.size();
-	size_t in_pos = 0;
+	strm->next_in = v_in.data();
+	strm->avail_in = v_in.size();
+	strm->next_out = v_out.data() + out_start;
+	strm->avail_out = v_out.size() - out_start;
 
 	while (true) {
-		if (strm->avail_in == 0 && in_pos < in_size) {
-			strm->next_in = inbuf;
-			size_t to_read = std::min((size_t) sizeof(inbuf), in_size - in_pos);
-			copy_n(v_in.begin() + in_pos, to_read, inbuf);
-			in_pos += to_read;
-			strm->avail_in = to_read;
-
-			if(in_pos == in_size)
-				action = LZMA_FINISH;
-		}
-
-		lzma_ret ret = lzma_code(strm, action);
+		lzma_ret ret = lzma_code(strm, LZMA_FINISH);
 
-		if (strm->avail_out == 0 || ret == LZMA_STREAM_END) {
-			size_t write_size = sizeof(outbuf) - strm->avail_out;
-
-			for (size_t i = 0; i < write_size; ++i)
-				v_out.push_back(outbuf[i]);
-
-			// Reset next_out and avail_out.
-			strm->next_out = outbuf;
-			strm->avail_out = sizeof(outbuf);
-		}
+		if (ret == LZMA_STREAM_END)
+			break;
 
 		if (ret != LZMA_OK) {
-			if (ret == LZMA_STREAM_END)
-				return true;
-	
 			cerr << "Some bug in LZMA compression\n";
+			v_out.resize(out_start);
 
 			return false;
 		}
+
+		if (strm->avail_out == 0)
+			grow_output(strm, v_out);
 	}
+
+	v_out.resize(strm->next_out - v_out.data());
+
+	return true;
+}
+
+// *******************************************************************************************
+// Enlarge the output vector (twice) and point the stream at its free part
+void CLZMAWrapper::grow_output(lzma_stream *strm, vector<uint8_t> &v_out)
+{
+	size_t used = strm->next_out - v_out.data();
+
+	v_out.resize(max<size_t>(2 * v_out.size(), LZMA_MIN_OUTPUT_SIZE));
+
+	strm->next_out = v_out.data() + used;
+	strm->avail_out = v_out.size() - used;
+}
+
+// *******************************************************************************************
+// Read the uncompressed size from the index of xz stream (of the last one if they are concatenated)
+// Returns 0 if it cannot be read
+size_t CLZMAWrapper::stored_uncompressed_size(vector<uint8_t> &v_in)
+{
+	if (v_in.size() < 2 * LZMA_STREAM_HEADER_SIZE)
+		return 0;
+
+	lzma_stream_flags footer_flags;
+	size_t footer_pos = v_in.size() - LZMA_STREAM_HEADER_SIZE;
+
+	if (lzma_stream_footer_decode(&footer_flags, v_in.data() + footer_pos) != LZMA_OK || 
+		footer_flags.backward_size > footer_pos - LZMA_STREAM_HEADER_SIZE)
+		return 0;
+
+	lzma_index *index = nullptr;
+	uint64_t memlimit = UINT64_MAX;
+	size_t in_pos = footer_pos - (size_t) footer_flags.backward_size;
+
+	if (lzma_index_buffer_decode(&index, &memlimit, nullptr, v_in.data(), &in_pos, footer_pos) != LZMA_OK)
+		return 0;
+
+	size_t size = (size_t) lzma_index_uncompressed_size(index);
+	lzma_index_end(index, nullptr);
+
+	return size;
 }
 
 // *******************************************************************************************
 // Initialize LZMA decoder
-bool CLZMAWrapper::init_decoder(lzma_stream *strm)
+// For raw LZMA2 stream (with preset dictionary) the size of dictionary must be given
+bool CLZMAWrapper::init_decoder(lzma_stream *strm, uint8_t dict_size_log)
 {
-	lzma_ret ret = lzma_stream_decoder(strm, UINT64_MAX, LZMA_CONCATENATED);
+	lzma_ret ret;
+
+	if (v_dictionary)
+	{
+		lzma_options_lzma opt_lzma;
+
+		lzma_lzma_preset(&opt_lzma, 0);
+		opt_lzma.dict_size = 1u << dict_size_log;
+		opt_lzma.preset_dict = v_dictionary->data();
+		opt_lzma.preset_dict_size = (uint32_t) v_dictionary->size();
+
+		lzma_filter filters[] = {
+			{ LZMA_FILTER_LZMA2, &opt_lzma },
+			{ LZMA_VLI_UNKNOWN, NULL }
+		};
+
+		ret = lzma_raw_decoder(strm, filters);
+	}
+	else
+		ret = lzma_stream_decoder(strm, UINT64_MAX, LZMA_CONCATENATED);
 
 	if (ret == LZMA_OK)
 		return true;
@@ -136,56 +272,137 @@ bool CLZMAWrapper::init_decoder(lzma_stream *strm)
 }
 
 // *******************************************************************************************
-// Do actual decompression
-bool CLZMAWrapper::decompress(lzma_stream *strm, vector<uint8_t> &v_in, vector<uint8_t> &v_out)
+// Do actual decompression - the whole input (from in_pos) is given to LZMA at once and the output 
+// is written directly to the vector (sized from out_size if known)
+bool CLZMAWrapper::decompress(lzma_stream *strm, vector<uint8_t> &v_in, size_t in_pos, size_t out_size, vector<uint8_t> &v_out)
 {
-	lzma_action action = LZMA_RUN;
+	size_t out_start = v_out.size();
 
-	uint8_t inbuf[BUFSIZ];
-	uint8_t outbuf[BUFSIZ];
+	// One spare byte, so the output buffer is not exhausted before the end of the stream
+	v_out.resize(out_start + (out_size ? out_size + 1 : LZMA_MIN_OUTPUT_SIZE));
 
-	strm->next_in = NULL;
-	strm->avail_in = 0;
-	strm->next_out = outbuf;
-	strm->avail_out = sizeof(outbuf);
-
-	size_t in_pos = 0;
-	size_t in_size = v_in.size();
+	strm->next_in = v_in.data() + in_pos;
+	strm->avail_in = v_in.size() - in_pos;
+	strm->next_out = v_out.data() + out_start;
+	strm->avail_out = v_out.size() - out_start;
 
 	while (true) {
-		if (strm->avail_in == 0 && in_pos < in_size) {
-			strm->next_in = inbuf;
-
-			size_t to_read = std::min((size_t) sizeof(inbuf), in_size - in_pos);
-			copy_n(v_in.begin() + in_pos, to_read, inbuf);
-			in_pos += to_read;
-			strm->avail_in = to_read;
-			
-			if(in_pos == in_size)
-				action = LZMA_FINISH;
+		lzma_ret ret = lzma_code(strm, LZMA_FINISH);
+
+		if (ret == LZMA_STREAM_END)
+			break;
+
+		if (ret != LZMA_OK) {
+			v_out.resize(out_start);
+
+			return false;
 		}
 
-		lzma_ret ret = lzma_code(strm, action);
+		if (strm->avail_out == 0)
+			grow_output(strm, v_out);
+	}
 
-		if (strm->avail_out == 0 || ret == LZMA_STREAM_END) {
-			size_t write_size = sizeof(outbuf) - strm->avail_out;
+	v_out.resize(strm->next_out - v_out.data());
 
-			for (size_t i = 0; i < write_size; ++i)
-				v_out.push_back(outbuf[i]);
+	return true;
+}
 
-			strm->next_out = outbuf;
-			strm->avail_out = sizeof(outbuf);
-		}
+// *******************************************************************************************
+// CLZMADictionaryTrainer
+// *******************************************************************************************
 
-		if (ret != LZMA_OK) {
-			if (ret == LZMA_STREAM_END)
-				return true;
+// *******************************************************************************************
+// Collect the candidates from the line
+void CLZMADictionaryTrainer::add_candidates(const string &line, vector<string> &v_strings)
+{
+	if (line.size() > LZMA_TRAIN_MAX_STRING_LEN)
+		return;
 
-			return false;
+	v_strings.push_back(line + "\n");
+
+	size_t word_start = 0;
+	for (size_t i = 1; i <= line.size(); ++i)
+	{
+		bool word_end = i == line.size() || line[i] == ' ' || line[i] == '\t';
+		bool prev_word_end = line[i - 1] == ' ' || line[i - 1] == '\t';
+
+		if (word_end && !prev_word_end)
+			v_strings.push_back(line.substr(word_start, i - word_start));
+		else if (!word_end && prev_word_end)
+		{
+			v_strings.push_back(line.substr(0, i));
+			word_start = i;
 		}
 	}
+}
 
-	return true;
+// *******************************************************************************************
+// Add text to the training set
+void CLZMADictionaryTrainer::Add(const vector<uint8_t> &v_text)
+{
+	unordered_set<string> s_strings;
+	vector<string> v_strings;
+	string line;
+
+	for (auto c : v_text)
+		if (c == '\n')
+		{
+			add_candidates(line, v_strings);
+			line.clear();
+		}
+		else
+			line.push_back((char) c);
+	add_candidates(line, v_strings);
+
+	// Each string is counted once per text
+	for (auto &x : v_strings)
+		if (x.size() > 1 && s_strings.insert(x).second)
+			++m_candidates[x];
+}
+
+// *******************************************************************************************
+// Build the dictionary of (at most) dict_size bytes. The most valuable strings are at the end, 
+// where the LZMA distances to them are the shortest.
+void CLZMADictionaryTrainer::Build(size_t dict_size, vector<uint8_t> &v_dictionary)
+{
+	vector<pair<size_t, const string *>> v_scored;
+
+	for (auto &x : m_candidates)
+		if (x.second > 1)
+			v_scored.emplace_back((x.second - 1) * x.first.size(), &x.first);
+
+	sort(v_scored.begin(), v_scored.end(), [](const pair<size_t, const string *> &a, const pair<size_t, const string *> &b) {
+		return a.first != b.first ? a.first > b.first : *a.second < *b.second;
+	});
+
+	// Strings covered by the chosen ones (their prefixes and words) are skipped
+	unordered_set<string> s_covered;
+	vector<const string *> v_chosen;
+	vector<string> v_parts;
+	size_t size = 0;
+
+	for (auto &x : v_scored)
+	{
+		const string &s = *x.second;
+
+		if (size + s.size() > dict_size)
+			continue;
+		if (s_covered.count(s))
+			continue;
+
+		v_chosen.push_back(&s);
+		size += s.size();
+
+		v_parts.clear();
+		add_candidates(s.back() == '\n' ? s.substr(0, s.size() - 1) : s, v_parts);
+		s_covered.insert(v_parts.begin(), v_parts.end());
+	}
+
+	v_dictionary.clear();
+	v_dictionary.reserve(size);
+
+	for (auto p = v_chosen.rbegin(); p != v_chosen.rend(); ++p)
+		v_dictionary.insert(v_dictionary.end(), (*p)->begin(), (*p)->end());
 }
 
 // EOF
@@ -10,12 +10,44 @@
 
 #include <vector>
 #include <string>
+#include <unordered_map>
 
 #define LZMA_API_STATIC
 #include "lzma.h"
 
 using namespace std;
 
+const size_t LZMA_MIN_OUTPUT_SIZE = 1 << 16;		// initial size of output buffer if the size of data is not known
+const size_t LZMA_MT_MIN_SIZE = 1 << 23;			// smaller texts are compressed by a single thread
+const size_t LZMA_MT_MIN_BLOCK_SIZE = 1 << 22;		// min. size of independently compressed blocks of text
+const size_t LZMA_TRAIN_MAX_STRING_LEN = 256;		// longer lines are not used as candidates for preset dictionary
+const size_t LZMA_RAW_HEADER_SIZE = 5;				// log of dictionary size and CRC32 of text preceding raw LZMA2 stream
+
+// *******************************************************************************************
+// LZMA streams kept between families. liblzma reuses the coder and its buffers when the stream 
+// is initialised again (they are reallocated only if the dictionary size changes).
+// *******************************************************************************************
+class CLZMAStreams
+{
+public:
+	lzma_stream encoder;
+	lzma_stream decoder;
+
+	CLZMAStreams()
+	{
+		lzma_stream strm = LZMA_STREAM_INIT;
+
+		encoder = strm;
+		decoder = strm;
+	}
+
+	~CLZMAStreams()
+	{
+		lzma_end(&encoder);
+		lzma_end(&decoder);
+	}
+};
+
 // *******************************************************************************************
 //
 // *******************************************************************************************
@@ -27,23 +59,57 @@ class CLZMAWrapper
 
 	bool forward_mode;
 	int compression_mode;
+	CLZMAStreams *streams;				// if not given, the coder is created for each text
+	int n_threads;						// used only for compression of large texts
+	const vector<uint8_t> *v_dictionary;	// if given, the text is coded as raw LZMA2 stream with this preset dictionary
+	bool success;
 
 	void forward();
 	void reverse();
 
-	bool init_encoder(lzma_stream *strm, uint32_t preset);
-	bool init_decoder(lzma_stream *strm);
+	bool init_encoder(lzma_stream *strm, uint32_t preset, size_t text_size, uint8_t &dict_size_log);
+	bool init_decoder(lzma_stream *strm, uint8_t dict_size_log);
 
 	bool compress(lzma_stream *strm, vector<uint8_t> &v_in, vector<uint8_t> &v_out);
-	bool decompress(lzma_stream *strm, vector<uint8_t> &v_in, vector<uint8_t> &v_out);
+	bool decompress(lzma_stream *strm, vector<uint8_t> &v_in, size_t in_pos, size_t out_size, vector<uint8_t> &v_out);
+
+	void grow_output(lzma_stream *strm, vector<uint8_t> &v_out);
+	size_t stored_uncompressed_size(vector<uint8_t> &v_in);
 
 public:
-	CLZMAWrapper(vector<uint8_t> *_v_text, vector<uint8_t> *_v_text_compressed, bool _forward_mode, int _compression_mode = 0) : 
-		v_text(_v_text), v_text_compressed(_v_text_compressed), forward_mode(_forward_mode), compression_mode(_compression_mode)
+	CLZMAWrapper(vector<uint8_t> *_v_text, vector<uint8_t> *_v_text_compressed, bool _forward_mode, int _compression_mode = 0, CLZMAStreams *_streams = nullptr, 
+		int _n_threads = 1, const vector<uint8_t> *_v_dictionary = nullptr) : 
+		v_text(_v_text), v_text_compressed(_v_text_compressed), forward_mode(_forward_mode), compression_mode(_compression_mode), streams(_streams), 
+		n_threads(_n_threads), v_dictionary(_v_dictionary), success(true)
 	{
 	};
 
 	void operator()();
+
+	// False after errors, e.g., for corrupted compressed text
+	bool Success() const
+	{
+		return success;
+	}
+};
+
+// *******************************************************************************************
+// Training of preset dictionary for a collection of similar texts (e.g., metadata of families).
+// Candidates are lines, their prefixes ending before the consecutive words, and single words.
+// The ones occurring in many texts are taken (weighted by their lengths).
+// *******************************************************************************************
+class CLZMADictionaryTrainer
+{
+	unordered_map<string, uint32_t> m_candidates;		// no. of texts containing the string
+
+	void add_candidates(const string &line, vector<string> &v_strings);
+
+public:
+	CLZMADictionaryTrainer()
+	{};
+
+	void Add(const vector<uint8_t> &v_text);
+	void Build(size_t dict_size, vector<uint8_t> &v_dictionary);
 };
 
 // EOF
@@ -0,0 +1,350 @@
+// *******************************************************************************************
+// This file is a part of CoMSA software distributed under GNU GPL 3 licence.
+// The homepage of the CoMSA project is http://sun.aei.polsl.pl/REFRESH/CoMSA
+//
+// Author : Sebastian Deorowicz
+// Version: 1.2
+// Date   : 2018-10-04
+// *******************************************************************************************
+
+#include <algorithm>
+#include "meta_codec.h"
+
+const string GS_PREFIX = "#=GS ";
+
+// *******************************************************************************************
+// Sequence names without the white spaces separating them from the sequences
+void CMetaCodec::prepare_names(const vector<string> &v_names)
+{
+	v_trimmed_names.clear();
+	m_names.clear();
+
+	v_trimmed_names.reserve(v_names.size());
+
+	for (uint32_t i = 0; i < v_names.size(); ++i)
+	{
+		auto &s = v_names[i];
+		auto len = s.find_last_not_of(" \t");
+
+		v_trimmed_names.emplace_back(s, 0, len == string::npos ? 0 : len + 1);
+		m_names.emplace(v_trimmed_names.back(), i);			// the first occurrence is used for duplicated names
+	}
+}
+
+// *******************************************************************************************
+// Split #=GS line into fields. Lines of other layouts (e.g., with tabs or without a value) are not coded.
+bool CMetaCodec::parse_line(const vector<uint8_t> &line, string &name, uint32_t &n_name_spaces, string &tag, uint32_t &n_tag_spaces, string &value)
+{
+	size_t n = line.size();
+
+	if (n < GS_PREFIX.size() || !equal(GS_PREFIX.begin(), GS_PREFIX.end(), line.begin()))
+		return false;
+
+	size_t p = GS_PREFIX.size();
+	size_t q;
+
+	for (q = p; q < n && line[q] != ' ' && line[q] != '\t'; ++q)
+		;
+	if (q == p || q == n || line[q] == '\t')
+		return false;
+	name.assign(line.begin() + p, line.begin() + q);
+
+	for (p = q; q < n && line[q] == ' '; ++q)
+		;
+	n_name_spaces = (uint32_t) (q - p);
+
+	for (p = q; q < n && line[q] != ' ' && line[q] != '\t'; ++q)
+		;
+	if (q == p || q == n || line[q] == '\t')
+		return false;
+	tag.assign(line.begin() + p, line.begin() + q);
+
+	for (p = q; q < n && line[q] == ' '; ++q)
+		;
+	n_tag_spaces = (uint32_t) (q - p);
+
+	value.assign(line.begin() + q, line.end());
+
+	return true;
+}
+
+// *******************************************************************************************
+// Split sequence name of the form base/start-end (the numbers must be restored exactly from their values)
+bool CMetaCodec::parse_range(const string &name, string &base, uint32_t &start, uint32_t &end)
+{
+	auto p_slash = name.rfind('/');
+	if (p_slash == string::npos || p_slash == 0)
+		return false;
+
+	auto p_dash = name.find('-', p_slash);
+	if (p_dash == string::npos)
+		return false;
+
+	auto parse_number = [](const string &s, size_t from, size_t to, uint32_t &x) {
+		if (from == to || to - from > GS_MAX_RANGE_DIGITS || (s[from] == '0' && to - from > 1))
+			return false;
+
+		x = 0;
+		for (size_t i = from; i < to; ++i)
+		{
+			if (s[i] < '0' || s[i] > '9')
+				return false;
+			x = x * 10 + (s[i] - '0');
+		}
+
+		return true;
+	};
+
+	if (!parse_number(name, p_slash + 1, p_dash, start) || !parse_number(name, p_dash + 1, name.size(), end) || end < start)
+		return false;
+
+	base.assign(name, 0, p_slash);
+
+	return true;
+}
+
+// *******************************************************************************************
+// Accession predicted from sequence name, e.g., A0A0A0MTA4_9BACT/10-100 -> A0A0A0MTA4
+string CMetaCodec::accession(const string &name)
+{
+	return name.substr(0, name.find_first_of("_/"));
+}
+
+// *******************************************************************************************
+void CMetaCodec::put_uint(vector<uint8_t> &vu, uint32_t x)
+{
+	for (; x >= 0x80; x >>= 7)
+		vu.push_back((uint8_t) ((x & 0x7f) | 0x80));
+	vu.push_back((uint8_t) x);
+}
+
+// *******************************************************************************************
+uint32_t CMetaCodec::get_uint(const vector<uint8_t> &vu, size_t &pos)
+{
+	uint32_t x = 0;
+
+	for (uint32_t shift = 0; pos < vu.size(); shift += 7)
+	{
+		uint8_t c = vu[pos++];
+		x += ((uint32_t) (c & 0x7f)) << shift;
+		if (c < 0x80)
+			break;
+	}
+
+	return x;
+}
+
+// *******************************************************************************************
+void CMetaCodec::put_string(vector<uint8_t> &vu, const string &s)
+{
+	vu.insert(vu.end(), s.begin(), s.end());
+	vu.push_back('\n');
+}
+
+// *******************************************************************************************
+string CMetaCodec::get_string(const vector<uint8_t> &vu, size_t &pos)
+{
+	auto p = find(vu.begin() + pos, vu.end(), '\n');
+	string s(vu.begin() + pos, p);
+
+	pos = min<size_t>(vu.size(), p - vu.begin() + 1);
+
+	return s;
+}
+
+// *******************************************************************************************
+void CMetaCodec::Encode(const vector<vector<uint8_t>> &v_meta, const vector<string> &v_names, vector<vector<uint8_t>> &v_meta_rest,
+	vector<vector<uint8_t>> &v_streams)
+{
+	v_meta_rest.clear();
+	v_meta_rest.reserve(v_meta.size());
+	v_streams.assign(GS_NO_STREAMS, vector<uint8_t>());
+
+	v_tags.clear();
+	m_tags.clear();
+	prepare_names(v_names);
+
+	auto &v_flags = v_streams[(int) gs_stream_t::flags];
+	auto &v_numbers = v_streams[(int) gs_stream_t::numbers];
+	auto &v_widths = v_streams[(int) gs_stream_t::widths];
+	auto &v_tag_ids = v_streams[(int) gs_stream_t::tags];
+	auto &v_literal_names = v_streams[(int) gs_stream_t::names];
+	auto &v_values = v_streams[(int) gs_stream_t::values];
+
+	string name, tag, value, base, prev_name;
+	uint32_t n_name_spaces, n_tag_spaces, start, end;
+	uint32_t next_id = 0;
+	bool any_coded = false;
+
+	for (auto &line : v_meta)
+	{
+		if (!parse_line(line, name, n_name_spaces, tag, n_tag_spaces, value) ||
+			(m_tags.count(tag) == 0 && v_tags.size() >= GS_MAX_TAGS))
+		{
+			v_meta_rest.push_back(line);
+			continue;
+		}
+
+		// Sequence name
+		gs_name_t name_kind;
+		auto p_name = m_names.find(name);
+
+		if (any_coded && name == prev_name)
+			name_kind = gs_name_t::previous;
+		else if (next_id < v_trimmed_names.size() && v_trimmed_names[next_id] == name)
+		{
+			name_kind = gs_name_t::next;
+			++next_id;
+		}
+		else if (p_name != m_names.end())
+		{
+			// Delta (zig-zag) to the name following the recent one
+			int64_t delta = (int64_t) p_name->second - (int64_t) next_id;
+
+			name_kind = gs_name_t::indexed;
+			put_uint(v_numbers, (uint32_t) (delta >= 0 ? 2 * delta : -2 * delta - 1));
+			next_id = p_name->second + 1;
+		}
+		else if (parse_range(name, base, start, end))
+		{
+			name_kind = gs_name_t::literal_range;
+			put_string(v_literal_names, base);
+			put_uint(v_numbers, start);
+			put_uint(v_numbers, end - start);
+		}
+		else
+		{
+			name_kind = gs_name_t::literal;
+			put_string(v_literal_names, name);
+		}
+
+		prev_name = name;
+		any_coded = true;
+
+		// Value
+		uint8_t flags = (uint8_t) name_kind;
+		string acc = accession(name);
+
+		if (!acc.empty() && value.compare(0, acc.size(), acc) == 0)
+		{
+			flags |= GS_FLAG_ACCESSION;
+			value.erase(0, acc.size());
+		}
+
+		v_flags.push_back(flags);
+		put_uint(v_widths, (uint32_t) name.size() + n_name_spaces);
+		put_uint(v_widths, n_tag_spaces);
+
+		// Tag
+		auto p_tag = m_tags.find(tag);
+		if (p_tag != m_tags.end())
+			put_uint(v_tag_ids, p_tag->second);
+		else
+		{
+			put_uint(v_tag_ids, (uint32_t) v_tags.size());
+			put_string(v_tag_ids, tag);
+			m_tags.emplace(tag, (uint32_t) v_tags.size());
+			v_tags.push_back(tag);
+		}
+
+		put_string(v_values, value);
+
+		v_meta_rest.push_back(vector<uint8_t>());
+	}
+}
+
+// *******************************************************************************************
+bool CMetaCodec::Decode(vector<vector<uint8_t>> &v_meta, const vector<string> &v_names, const vector<vector<uint8_t>> &v_streams)
+{
+	if (v_streams.size() != GS_NO_STREAMS)
+		return false;
+
+	v_tags.clear();
+	prepare_names(v_names);
+
+	auto &v_flags = v_streams[(int) gs_stream_t::flags];
+	auto &v_numbers = v_streams[(int) gs_stream_t::numbers];
+	auto &v_widths = v_streams[(int) gs_stream_t::widths];
+	auto &v_tag_ids = v_streams[(int) gs_stream_t::tags];
+	auto &v_literal_names = v_streams[(int) gs_stream_t::names];
+	auto &v_values = v_streams[(int) gs_stream_t::values];
+
+	size_t flags_pos = 0, numbers_pos = 0, widths_pos = 0, tags_pos = 0, names_pos = 0, values_pos = 0;
+
+	string name;
+	uint32_t next_id = 0;
+
+	for (auto &line : v_meta)
+	{
+		if (!line.empty())
+			continue;
+
+		if (flags_pos >= v_flags.size())
+			return false;
+
+		uint8_t flags = v_flags[flags_pos++];
+
+		switch ((gs_name_t) (flags & GS_FLAG_NAME_MASK))
+		{
+		case gs_name_t::previous:
+			break;
+		case gs_name_t::next:
+			if (next_id >= v_trimmed_names.size())
+				return false;
+			name = v_trimmed_names[next_id++];
+			break;
+		case gs_name_t::indexed:
+		{
+			uint32_t x = get_uint(v_numbers, numbers_pos);
+			int64_t id = (int64_t) next_id + ((x & 1) ? -(int64_t) (x / 2) - 1 : (int64_t) (x / 2));
+
+			if (id < 0 || id >= (int64_t) v_trimmed_names.size())
+				return false;
+			name = v_trimmed_names[id];
+			next_id = (uint32_t) id + 1;
+			break;
+		}
+		case gs_name_t::literal_range:
+		{
+			name = get_string(v_literal_names, names_pos);
+			uint32_t start = get_uint(v_numbers, numbers_pos);
+			uint32_t len = get_uint(v_numbers, numbers_pos);
+			name += "/" + to_string(start) + "-" + to_string(start + len);
+			break;
+		}
+		case gs_name_t::literal:
+			name = get_string(v_literal_names, names_pos);
+			break;
+		default:
+			return false;
+		}
+
+		uint32_t width = get_uint(v_widths, widths_pos);
+		uint32_t n_tag_spaces = get_uint(v_widths, widths_pos);
+
+		if (width <= name.size())
+			return false;
+
+		uint32_t tag_id = get_uint(v_tag_ids, tags_pos);
+		if (tag_id == v_tags.size())
+			v_tags.push_back(get_string(v_tag_ids, tags_pos));
+		else if (tag_id > v_tags.size())
+			return false;
+
+		string value = get_string(v_values, values_pos);
+		if (flags & GS_FLAG_ACCESSION)
+			value = accession(name) + value;
+
+		line.reserve(GS_PREFIX.size() + width + v_tags[tag_id].size() + n_tag_spaces + value.size());
+		line.insert(line.end(), GS_PREFIX.begin(), GS_PREFIX.end());
+		line.insert(line.end(), name.begin(), name.end());
+		line.insert(line.end(), width - name.size(), ' ');
+		line.insert(line.end(), v_tags[tag_id].begin(), v_tags[tag_id].end());
+		line.insert(line.end(), n_tag_spaces, ' ');
+		line.insert(line.end(), value.begin(), value.end());
+	}
+
+	return true;
+}
+
+// EOF
@@ -0,0 +1,75 @@
+#pragma once
+// *******************************************************************************************
+// This file is a part of CoMSA software distributed under GNU GPL 3 licence.
+// The homepage of the CoMSA project is http://sun.aei.polsl.pl/REFRESH/CoMSA
+//
+// Author : Sebastian Deorowicz
+// Version: 1.2
+// Date   : 2018-10-04
+// *******************************************************************************************
+
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include "defs.h"
+
+using namespace std;
+
+// Streams of fields of #=GS lines
+//   * flags   - kind of sequence name and accession prediction (a byte per line)
+//   * numbers - indices of sequence names and ranges of literal names
+//   * widths  - widths of name fields and no. of spaces after tags
+//   * tags    - indices of tags (new tags are given literally)
+//   * names   - literal sequence names (not found among the sequences of family)
+//   * values  - free texts (without the accession predicted from sequence name)
+enum class gs_stream_t {flags, numbers, widths, tags, names, values};
+const int GS_NO_STREAMS = 6;
+
+// Kinds of sequence names in #=GS lines
+enum class gs_name_t {previous, next, indexed, literal_range, literal};
+
+const uint8_t GS_FLAG_NAME_MASK = 7;
+const uint8_t GS_FLAG_ACCESSION = 8;		// the value starts with the accession taken from sequence name
+const uint32_t GS_MAX_TAGS = 255;
+const uint32_t GS_MAX_RANGE_DIGITS = 9;
+
+// *******************************************************************************************
+// Columnar coding of #=GS lines of Stockholm families:
+//     #=GS <name>[/<start>-<end>] <spaces> <tag> <spaces> <value>
+// The fields are moved to separate streams, which are much better compressed by LZMA than
+// the lines. Names are (usually) references to the sequences of family, so their ranges are
+// not stored at all; the ranges of other names are delta coded. Tags are coded by a dictionary
+// and the accessions (e.g., AC lines) are predicted from the sequence names.
+// The coded lines are left empty in the metadata to keep their positions.
+// *******************************************************************************************
+class CMetaCodec
+{
+	vector<string> v_tags;
+	unordered_map<string, uint32_t> m_tags;
+	unordered_map<string, uint32_t> m_names;
+	vector<string> v_trimmed_names;
+
+	void prepare_names(const vector<string> &v_names);
+
+	bool parse_line(const vector<uint8_t> &line, string &name, uint32_t &n_name_spaces, string &tag, uint32_t &n_tag_spaces, string &value);
+	bool parse_range(const string &name, string &base, uint32_t &start, uint32_t &end);
+	string accession(const string &name);
+
+	void put_uint(vector<uint8_t> &vu, uint32_t x);
+	uint32_t get_uint(const vector<uint8_t> &vu, size_t &pos);
+	void put_string(vector<uint8_t> &vu, const string &s);
+	string get_string(const vector<uint8_t> &vu, size_t &pos);
+
+public:
+	CMetaCodec()
+	{};
+
+	// Move #=GS lines to the streams (the lines in v_meta_rest are left empty)
+	void Encode(const vector<vector<uint8_t>> &v_meta, const vector<string> &v_names, vector<vector<uint8_t>> &v_meta_rest,
+		vector<vector<uint8_t>> &v_streams);
+
+	// Restore #=GS lines in place of the empty lines of v_meta
+	bool Decode(vector<vector<uint8_t>> &v_meta, const vector<string> &v_names, const vector<vector<uint8_t>> &v_streams);
+};
+
+// EOF
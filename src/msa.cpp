@@ -9,6 +9,7 @@
 
 #include "msa.h"
 #include <iostream>
+#include <iterator>
 
 // *******************************************************************************************
 //
@@ -25,6 +26,21 @@ CMSACompress::CMSACompress()
 
 	RLE0_fwd_mode = stage_mode_t::forward;
 	RLE0_rev_mode = stage_mode_t::reverse;
+
+	second_stage = second_stage_t::wfc;
+	column_info_mode = false;
+	gap_mask_mode = false;
+	sub_matrices_mode = true;
+	entropy_block_size = 0;
+	entropy_backend = entropy_backend_t::range_coder;
+	run_lengths_mode = false;
+	ctx_trial_mode = false;
+	gs_fields_mode = true;
+	annotation_rows_mode = true;
+	n_threads = 1;
+	n_entropy_threads = 1;
+	text_dictionary_used = false;
+	gs_fields_used = false;
 }
 
 // *******************************************************************************************
@@ -33,6 +49,77 @@ CMSACompress::~CMSACompress()
 {
 }
 
+// *******************************************************************************************
+// Turn on/off separate description of constant, repeated and near-constant columns
+void CMSACompress::SetColumnInfoMode(bool _column_info_mode)
+{
+	column_info_mode = _column_info_mode;
+}
+
+// *******************************************************************************************
+// Turn on/off separate coding of gaps and residues
+void CMSACompress::SetGapMaskMode(bool _gap_mask_mode)
+{
+	gap_mask_mode = _gap_mask_mode;
+}
+
+// *******************************************************************************************
+// Turn on/off separate compression of match and insert columns
+void CMSACompress::SetSubMatricesMode(bool _sub_matrices_mode)
+{
+	sub_matrices_mode = _sub_matrices_mode;
+}
+
+// *******************************************************************************************
+// Set size (in symbols) of independently entropy coded blocks (0 - single stream)
+void CMSACompress::SetEntropyBlockSize(size_t _entropy_block_size)
+{
+	entropy_block_size = _entropy_block_size;
+}
+
+// *******************************************************************************************
+// Select entropy coder: range coder or static Huffman
+void CMSACompress::SetEntropyBackend(entropy_backend_t _entropy_backend)
+{
+	entropy_backend = _entropy_backend;
+}
+
+// *******************************************************************************************
+// Turn on/off coding of zero-runs by the entropy coder (in place of RLE-0 stage)
+void CMSACompress::SetRunLengthsMode(bool _run_lengths_mode)
+{
+	run_lengths_mode = _run_lengths_mode;
+}
+
+// *******************************************************************************************
+// Turn on/off selection of context lengths by trial coding (in place of the thresholds of family size)
+void CMSACompress::SetCtxTrialMode(bool _ctx_trial_mode)
+{
+	ctx_trial_mode = _ctx_trial_mode;
+}
+
+// *******************************************************************************************
+// Turn on/off columnar coding of fields of #=GS lines of Stockholm families
+void CMSACompress::SetGSFieldsMode(bool _gs_fields_mode)
+{
+	gs_fields_mode = _gs_fields_mode;
+}
+
+// *******************************************************************************************
+// Turn on/off compression of per-column annotations of Stockholm families as a separate matrix
+void CMSACompress::SetAnnotationRowsMode(bool _annotation_rows_mode)
+{
+	annotation_rows_mode = _annotation_rows_mode;
+}
+
+// *******************************************************************************************
+// Set no. of threads used for parallel parts of stages
+void CMSACompress::SetNoThreads(int _n_threads)
+{
+	n_threads = max(_n_threads, 1);
+	n_entropy_threads = n_threads;
+}
+
 #ifdef EXPERIMENTAL_MODE
 // *******************************************************************************************
 void CMSACompress::SetCopyModes(bool Transpose_copy_mode, bool PBWT_copy_mode, bool SS_copy_mode, bool RLE0_copy_mode)
@@ -70,18 +157,16 @@ void CMSACompress::SetCopyModes(bool Transpose_copy_mode, bool PBWT_copy_mode, b
 //    * v_offsets    - offsets between metadata included in the sequence part of block
 //    * v_names		 - ids of sequences
 //    * v_sequences  - protein sequences
-//    * fast_variant - turn on MTF (much faster) instead of WFC 
+//    * second_stage - WFC, MTF (much faster) or automatic choice per family
 bool CMSACompress::Compress(vector<vector<uint8_t>> &v_meta, vector<uint32_t> &v_offsets, vector<string> &v_names, vector<string> &v_sequences, vector<uint8_t> &v_compressed_data,
-	size_t &comp_text_size, size_t &comp_seq_size, bool _fast_variant)
+	size_t &comp_text_size, size_t &comp_seq_size, second_stage_t _second_stage)
 {
 	v_text.clear();
-	append_text(v_meta);
-	append_text(v_names);
-	append_text(v_offsets);
+	append_stockholm_text(v_meta, v_names, v_offsets, v_sequences);
 
-	fast_variant = _fast_variant;
+	second_stage = _second_stage;
 
-	return compress(v_text, v_sequences, LZMA_mode_Stockholm, v_compressed_data, comp_text_size, comp_seq_size);
+	return compress(v_text, v_sequences, LZMA_mode_Stockholm, v_compressed_data, comp_text_size, comp_seq_size, &v_annotations);
 }
 
 // *******************************************************************************************
@@ -89,13 +174,15 @@ bool CMSACompress::Compress(vector<vector<uint8_t>> &v_meta, vector<uint32_t> &v
 // Parameters:
 //    * v_names		 - ids of sequences
 //    * v_sequences  - protein sequences
+//    * second_stage - WFC, MTF (much faster) or automatic choice
 bool CMSACompress::Compress(vector<string> &v_names, vector<string> &v_sequences, vector<uint8_t> &v_compressed_data,
-	size_t &comp_text_size, size_t &comp_seq_size, bool _fast_variant)
+	size_t &comp_text_size, size_t &comp_seq_size, second_stage_t _second_stage)
 {
 	v_text.clear();
 	append_text(v_names);
+	gs_fields_used = false;
 
-	fast_variant = _fast_variant;
+	second_stage = _second_stage;
 
 	return compress(v_text, v_sequences, LZMA_mode_FASTA, v_compressed_data, comp_text_size, comp_seq_size);
 }
@@ -106,7 +193,8 @@ bool CMSACompress::Decompress(vector<uint8_t> &v_compressed_data, vector<string>
 {
 	v_text.clear();
 
-	decompress(v_text, v_sequences, v_compressed_data);
+	if (!decompress(v_text, v_sequences, v_compressed_data))
+		return false;
 	
 	v_text_pos = 0;
 
@@ -120,17 +208,324 @@ bool CMSACompress::Decompress(vector<uint8_t> &v_compressed_data, vector<string>
 bool CMSACompress::Decompress(vector<uint8_t> &v_compressed_data, vector<vector<uint8_t>> &v_meta, vector<uint32_t> &v_offsets, vector<string> &v_names, vector<string> &v_sequences)
 {
 	v_text.clear();
-	decompress(v_text, v_sequences, v_compressed_data);
+	if (!decompress(v_text, v_sequences, v_compressed_data, &v_annotations))
+		return false;
 
 	v_text_pos = 0;
 		
-	load_text(v_meta);
-	load_text(v_names);
-	load_text(v_offsets);
+	if (!load_family_text(v_meta, v_names, v_offsets))
+		return false;
+
+	return v_annotations.empty() || merge_annotations(v_meta);
+}
+
+// *******************************************************************************************
+// Compression of consecutive small families of Stockholm file in a single super-block. 
+// The models of the entropy coder and LZMA adapt over all the families, so the costs of their 
+// learning and of the coder flushes are paid once per super-block.
+// Parameters:
+//    * v_families   - families (each smaller than SUPER_BLOCK_FAMILY_MAX_SIZE)
+//    * second_stage - WFC, MTF (much faster) or automatic choice per super-block
+bool CMSACompress::CompressSuperBlock(vector<msa_family_t> &v_families, vector<uint8_t> &v_compressed_data, size_t &comp_text_size, size_t &comp_seq_size, 
+	second_stage_t _second_stage)
+{
+	seq_block_t block;
+
+	v_text.clear();
+	gs_fields_used = gs_fields_mode;
+	for (auto &x : v_families)
+		append_family_text(x.v_meta, x.v_names, x.v_offsets);
+
+	second_stage = _second_stage;
+
+	// Text data - sequence names and metadata of all families in a single LZMA stream
+	v_text_compressed.clear();
+	int n_lzma_threads = split_threads(v_text.size());
+	text_dictionary_used = !v_text_dictionary.empty() && n_lzma_threads == 1;
+	CLZMAWrapper *lzma = new CLZMAWrapper(&v_text, &v_text_compressed, true, LZMA_mode_Stockholm, &lzma_streams, n_lzma_threads, 
+		text_dictionary_used ? &v_text_dictionary : nullptr);
+	thread *thr_lzma = new thread(std::ref(*lzma));
+
+	if (second_stage == second_stage_t::automatic)
+	{
+		// Super-blocks are small, so both variants are always tried
+		seq_block_t block_mtf, block_wfc;
+
+		block_mtf.fast_variant = true;
+		block_wfc.fast_variant = false;
+
+		thread thr_mtf([&] {compress_super_block(v_families, block_mtf); });
+		compress_super_block(v_families, block_wfc);
+		thr_mtf.join();
+
+		if (wfc_pays_off(block_mtf.size(), block_wfc.size()))
+			block = move(block_wfc);
+		else
+			block = move(block_mtf);
+	}
+	else
+	{
+		block.fast_variant = second_stage == second_stage_t::mtf;
+		compress_super_block(v_families, block);
+	}
+
+	thr_lzma->join();
+
+	delete lzma;
+	delete thr_lzma;
+
+	uint32_t ext_flags = block_flags(block);
+
+	if (text_dictionary_used)
+		ext_flags |= EXT_FLAG_TEXT_DICTIONARY;
+	if (gs_fields_used)
+		ext_flags |= EXT_FLAG_GS_FIELDS;
+
+	v_compressed_data.clear();
+	v_compressed_data.reserve(2 + (4 + 2 * v_families.size()) * sizeof(size_t) + block.size() + v_text_compressed.size());
+
+	v_compressed_data.push_back((uint8_t)block.ctx_length + FAMILY_FLAG_SUPER_BLOCK + (block.fast_variant ? FAMILY_FLAG_FAST_VARIANT : 0) + 
+		(ext_flags ? FAMILY_FLAG_EXTENDED : 0));
+	if (ext_flags)
+		store_uint(v_compressed_data, ext_flags);
+
+	store_uint(v_compressed_data, v_families.size());
+	for (auto &x : v_families)
+	{
+		store_uint(v_compressed_data, x.v_sequences.size());
+		store_uint(v_compressed_data, x.v_sequences.empty() ? 0 : x.v_sequences.front().size());
+	}
+
+	store_uint(v_compressed_data, v_text_compressed.size());
+	store_block_sizes(block, ext_flags, v_compressed_data);
+
+	v_compressed_data.insert(v_compressed_data.end(), v_text_compressed.begin(), v_text_compressed.end());
+	store_block_data(block, v_compressed_data);
+
+	comp_text_size = v_text_compressed.size();
+	comp_seq_size = block.size();
+
+	return true;
+}
+
+// *******************************************************************************************
+// Decompression of super-block of Stockholm families
+// If family_no is given, only the sequences of this family are reconstructed (the entropy 
+// decoding of the whole super-block is necessary anyway)
+bool CMSACompress::DecompressSuperBlock(vector<uint8_t> &v_compressed_data, vector<msa_family_t> &v_families, int family_no)
+{
+	seq_block_t block;
+	vector<uint8_t> v_text_compressed;
+	size_t vu_pos = 0;
+
+	if (v_compressed_data.empty())
+	{
+		cerr << "Corrupted super-block\n";
+		return false;
+	}
+
+	uint8_t t = v_compressed_data[vu_pos++];
+	uint32_t ext_flags = 0;
+
+	if (t & FAMILY_FLAG_EXTENDED)
+		ext_flags = (uint32_t) load_uint(v_compressed_data, vu_pos);
+
+	block.fast_variant = (t & FAMILY_FLAG_FAST_VARIANT) != 0;
+	block.ctx_length = (ctx_length_t) (t & ~(FAMILY_FLAG_SUPER_BLOCK | FAMILY_FLAG_FAST_VARIANT | FAMILY_FLAG_EXTENDED));
+
+	size_t n_families = load_uint(v_compressed_data, vu_pos);
+	if (n_families > SUPER_BLOCK_MAX_FAMILIES)
+	{
+		cerr << "Corrupted super-block\n";
+		return false;
+	}
+
+	v_families.clear();
+	v_families.resize(n_families);
+
+	// All families of a super-block are small, so larger dimensions mean corrupted data
+	vector<pair<uint32_t, uint32_t>> v_dims(v_families.size());
+	for (auto &x : v_dims)
+	{
+		x.first = (uint32_t) load_uint(v_compressed_data, vu_pos);
+		x.second = (uint32_t) load_uint(v_compressed_data, vu_pos);
+
+		if ((size_t) x.first * x.second >= SUPER_BLOCK_FAMILY_MAX_SIZE)
+		{
+			cerr << "Corrupted super-block\n";
+			return false;
+		}
+	}
+
+	size_t text_size = load_uint(v_compressed_data, vu_pos);
+	if (vu_pos > v_compressed_data.size() || text_size > v_compressed_data.size() - vu_pos)
+	{
+		cerr << "Corrupted super-block\n";
+		return false;
+	}
+
+	v_text_compressed.resize(text_size);
+	load_block_sizes(block, ext_flags, v_compressed_data, vu_pos);
+
+	if (vu_pos > v_compressed_data.size() || v_text_compressed.size() + block.size() > v_compressed_data.size() - vu_pos)
+	{
+		cerr << "Corrupted super-block\n";
+		return false;
+	}
+
+	copy_n(v_compressed_data.data() + vu_pos, v_text_compressed.size(), v_text_compressed.data());
+	vu_pos += v_text_compressed.size();
+	load_block_data(block, v_compressed_data, vu_pos);
+
+	text_dictionary_used = (ext_flags & EXT_FLAG_TEXT_DICTIONARY) != 0;
+	if (text_dictionary_used && v_text_dictionary.empty())
+	{
+		cerr << "No preset dictionary of metadata\n";
+		return false;
+	}
+	gs_fields_used = (ext_flags & EXT_FLAG_GS_FIELDS) != 0;
+
+	// Names and meta
+	v_text.clear();
+	CLZMAWrapper *lzma = new CLZMAWrapper(&v_text, &v_text_compressed, false, 0, &lzma_streams, 1, 
+		text_dictionary_used ? &v_text_dictionary : nullptr);
+	thread *thr_lzma = new thread(std::ref(*lzma));
+
+	// Columns of consecutive families follow each other in the entropy coded stream
+	vector<uint32_t> v_column_lengths;
+	vector<size_t> v_first_column;
+
+	for (auto &x : v_dims)
+	{
+		v_first_column.push_back(v_column_lengths.size());
+
+		if (x.first && x.second)
+			v_column_lengths.insert(v_column_lengths.end(), Transpose_rev_mode == stage_mode_t::reverse ? x.second : x.first, 
+				Transpose_rev_mode == stage_mode_t::reverse ? x.first : x.second);
+	}
+	v_first_column.push_back(v_column_lengths.size());
+
+	vector<string> v_columns;
+	v_columns.reserve(v_column_lengths.size());
+
+	if (!v_column_lengths.empty())
+	{
+		CVectorIOStream *v_pre_entropy = new CVectorIOStream(block.v_data);
+		CRegisteringPriorityQueue<string> *q_post_entropy = new CRegisteringPriorityQueue<string>(1);
+
+		CEntropy *entropy = new CEntropy(q_post_entropy, v_pre_entropy, block.pre_entropy_size, 0, false, 
+			entropy_params(block, block.entropy_blocks ? ENTROPY_BLOCK_SIZE : 0), n_threads, &v_column_lengths, &entropy_coder_pool);
+		(*entropy)();
+
+		uint64_t priority;
+		string column;
+		while (q_post_entropy->Pop(priority, column))
+			v_columns.emplace_back(move(column));
+
+		if (entropy->IsCorrupted())
+			v_columns.clear();
+
+		delete entropy;
+		delete q_post_entropy;
+		delete v_pre_entropy;
+	}
+
+	thr_lzma->join();
+	bool text_ok = lzma->Success();
+	delete lzma;
+	delete thr_lzma;
+
+	if (!text_ok)
+	{
+		cerr << "Corrupted names and metadata\n";
+		return false;
+	}
+
+	if (v_columns.size() != v_column_lengths.size())
+	{
+		cerr << "Corrupted super-block\n";
+		return false;
+	}
+
+	v_text_pos = 0;
+
+	for (size_t i = 0; i < v_families.size(); ++i)
+	{
+		auto &family = v_families[i];
+
+		if (!load_family_text(family.v_meta, family.v_names, family.v_offsets))
+			return false;
+
+		if ((family_no >= 0 && (size_t) family_no != i) || v_first_column[i] == v_first_column[i + 1])
+			continue;
+
+		vector<string> v_family_columns(make_move_iterator(v_columns.begin() + v_first_column[i]), make_move_iterator(v_columns.begin() + v_first_column[i + 1]));
+		seq_block_t family_block;
+
+		family_block.fast_variant = block.fast_variant;
+		if (!decompress_sequences(family_block, v_dims[i].first, v_dims[i].second, family.v_sequences, &v_family_columns))
+			return false;
+	}
 
 	return true;
 }
 
+// *******************************************************************************************
+// Train the preset dictionary of LZMA on the texts (names and metadata) of sample families. 
+// The dictionary is used for the next families and returned as a block to be stored in the archive.
+void CMSACompress::TrainTextDictionary(vector<msa_family_t> &v_sample, vector<uint8_t> &v_compressed_data)
+{
+	CLZMADictionaryTrainer trainer;
+
+	for (auto &x : v_sample)
+	{
+		v_text.clear();
+		append_stockholm_text(x.v_meta, x.v_names, x.v_offsets, x.v_sequences);
+
+		trainer.Add(v_text);
+	}
+
+	trainer.Build(TEXT_DICTIONARY_SIZE, v_text_dictionary);
+
+	v_text_compressed.clear();
+	CLZMAWrapper lzma(&v_text_dictionary, &v_text_compressed, true, LZMA_mode_Stockholm, &lzma_streams);
+	lzma();
+
+	v_compressed_data.clear();
+	v_compressed_data.push_back(BLOCK_TEXT_DICTIONARY);
+	v_compressed_data.insert(v_compressed_data.end(), v_text_compressed.begin(), v_text_compressed.end());
+}
+
+// *******************************************************************************************
+// Load the preset dictionary of LZMA from the block of archive
+bool CMSACompress::LoadTextDictionary(vector<uint8_t> &v_compressed_data)
+{
+	if (!IsTextDictionary(v_compressed_data))
+		return false;
+
+	v_text_compressed.assign(v_compressed_data.begin() + 1, v_compressed_data.end());
+	v_text_dictionary.clear();
+
+	CLZMAWrapper lzma(&v_text_dictionary, &v_text_compressed, false, 0, &lzma_streams);
+	lzma();
+
+	return lzma.Success();
+}
+
+// *******************************************************************************************
+// Check whether the block contains the preset dictionary
+bool CMSACompress::IsTextDictionary(vector<uint8_t> &v_compressed_data)
+{
+	return !v_compressed_data.empty() && v_compressed_data.front() == BLOCK_TEXT_DICTIONARY;
+}
+
+// *******************************************************************************************
+// Check whether the compressed block contains several families
+bool CMSACompress::IsSuperBlock(vector<uint8_t> &v_compressed_data)
+{
+	return !v_compressed_data.empty() && (v_compressed_data.front() & FAMILY_FLAG_SUPER_BLOCK);
+}
+
 // *******************************************************************************************
 // Append text to the metadata string 
 void CMSACompress::append_text(vector<string> &vs)
@@ -187,6 +582,38 @@ void CMSACompress::append_text(vector<uint32_t> &vu)
 		store_uint(v_text, x);
 }
 
+// *******************************************************************************************
+// Append binary stream to the metadata string 
+void CMSACompress::append_stream(vector<uint8_t> &vu)
+{
+	store_uint(v_text, vu.size());
+	v_text.insert(v_text.end(), vu.begin(), vu.end());
+}
+
+// *******************************************************************************************
+// Append names and metadata of Stockholm family to the metadata string.
+// If the fields of #=GS lines are coded separately, their streams follow the rest of the text.
+void CMSACompress::append_family_text(vector<vector<uint8_t>> &v_meta, vector<string> &v_names, vector<uint32_t> &v_offsets)
+{
+	if (!gs_fields_used)
+	{
+		append_text(v_meta);
+		append_text(v_names);
+		append_text(v_offsets);
+
+		return;
+	}
+
+	meta_codec.Encode(v_meta, v_names, v_meta_rest, v_gs_streams);
+
+	append_text(v_meta_rest);
+	append_text(v_names);
+	append_text(v_offsets);
+
+	for (auto &x : v_gs_streams)
+		append_stream(x);
+}
+
 // *******************************************************************************************
 // Load text from metadata string
 void CMSACompress::load_text(vector<string> &vs)
@@ -260,194 +687,948 @@ void CMSACompress::load_text(vector<uint32_t> &vu)
 }
 
 // *******************************************************************************************
-// Actual compression 
-bool CMSACompress::compress(vector<uint8_t> &v_text, vector<string> &v_sequences, uint32_t LZMA_mode, vector<uint8_t> &v_compressed_data,
-	size_t &comp_text_size, size_t &comp_seq_size)
+// Load binary stream from metadata string
+void CMSACompress::load_stream(vector<uint8_t> &vu)
 {
-	vector<uint8_t> v_seq_compressed;
+	size_t len = load_uint(v_text, v_text_pos);
 
-	// Classify file - to set context lengths
-	size_t file_size = 0;
-	ctx_length_t ctx_length;
-
-	if(!v_sequences.empty())
-		file_size = v_sequences.size() * v_sequences.front().size();
+	vu.assign(v_text.begin() + v_text_pos, v_text.begin() + v_text_pos + len);
+	v_text_pos += len;
+}
 
-	if (file_size < 10000)
-		ctx_length = ctx_length_t::tiny;		// 2, 1, 1
-	else if (file_size < 200000)
-		ctx_length = ctx_length_t::small;		// 3, 2, 1
-	else if (file_size < 5000000)
-		ctx_length = ctx_length_t::medium;		// 4, 2, 2
-	else if (file_size < 20000000)
-		ctx_length = ctx_length_t::large;		// 5, 2, 2
-	else
-		ctx_length = ctx_length_t::huge;		// 5, 3, 2
+// *******************************************************************************************
+// Load names and metadata of Stockholm family from metadata string
+bool CMSACompress::load_family_text(vector<vector<uint8_t>> &v_meta, vector<string> &v_names, vector<uint32_t> &v_offsets)
+{
+	load_text(v_meta);
+	load_text(v_names);
+	load_text(v_offsets);
 
-	// Queues
-#ifdef _DEBUG
-	int n_thr_ss = 1;
-#else
-	int n_thr_ss = fast_variant ? 2 : 4;	
-#endif
+	if (!gs_fields_used)
+		return true;
 
-	// Text data - sequence names and (optional) metadata
-	v_text_compressed.clear();
-	CLZMAWrapper *lzma = new CLZMAWrapper(&v_text, &v_text_compressed, true, LZMA_mode);
-	thread *thr_lzma = new thread(std::ref(*lzma));
+	v_gs_streams.resize(GS_NO_STREAMS);
+	for (auto &x : v_gs_streams)
+		load_stream(x);
 
-	if (!v_sequences.empty())
+	if (!meta_codec.Decode(v_meta, v_names, v_gs_streams))
 	{
-		// Sequence data
-		CRegisteringPriorityQueue<vector<string> *> *q_pre_transpose = new CRegisteringPriorityQueue<vector<string> *>(1);
-		CRegisteringPriorityQueue<string> *q_post_transpose = new CRegisteringPriorityQueue<string>(1);
-		CRegisteringPriorityQueue<string> *q_post_PBWT = new CRegisteringPriorityQueue<string>(1);
-		CRegisteringPriorityQueue<string> *q_post_SS = new CRegisteringPriorityQueue<string>(n_thr_ss);
-		CRegisteringPriorityQueue<string> *q_post_RLE = new CRegisteringPriorityQueue<string>(1);
-		CVectorIOStream *v_post_entropy = new CVectorIOStream(v_seq_compressed);
+		cerr << "Corrupted fields of #=GS lines\n";
+		return false;
+	}
 
-		// Transpose
-		CTranspose *transpose = new CTranspose(q_pre_transpose, q_post_transpose, 0, 0, Transpose_fwd_mode);
-		thread *thr_transpose = new thread(std::ref(*transpose));
+	return true;
+}
 
-		// PBWT
-		CPBWT *pbwt = new CPBWT(q_post_transpose, q_post_PBWT, PBWT_fwd_mode);
-		thread *thr_pbwt = new thread(std::ref(*pbwt));
+// *******************************************************************************************
+// Cut per-column annotations (the last field of #=GR and #=GC lines of the alignment width) 
+// off the metadata lines. The rest of the lines is stored in v_meta_prefixes.
+// Returns false if there are no such annotations (or they are too small to form a matrix)
+bool CMSACompress::split_annotations(vector<vector<uint8_t>> &v_meta, size_t n_columns)
+{
+	v_annotations.clear();
+	v_annotated_lines.clear();
 
-		vector<CSecondStage *> v_ss(n_thr_ss);
-		vector<thread *> v_thr_ss(n_thr_ss);
+	if (!n_columns)
+		return false;
 
-		if (fast_variant)
-		{
-			// MTF
-			for (int i = 0; i < n_thr_ss; ++i)
-			{
-				v_ss[i] = new CMTF(q_post_PBWT, q_post_SS, SS_fwd_mode);
-				v_thr_ss[i] = new thread(std::ref(*(v_ss[i])));
-			}
-		}
-		else
-		{
-			// WFC
-			for (int i = 0; i < n_thr_ss; ++i)
-			{
-				v_ss[i] = new CWFC(q_post_PBWT, q_post_SS, SS_fwd_mode);
-				v_thr_ss[i] = new thread(std::ref(*(v_ss[i])));
-			}
-		}
+	uint32_t prev_line = 0;
 
-		// RLE-0
-		CRLE *rle = new CRLE(q_post_SS, q_post_RLE, RLE0_fwd_mode);
-		thread *thr_rle = new thread(std::ref(*rle));
+	for (uint32_t i = 0; i < v_meta.size(); ++i)
+	{
+		auto &line = v_meta[i];
 
-		// Entropy
-		CEntropy *entropy = new CEntropy(q_post_RLE, v_post_entropy, pre_entropy_sequences_size, 0, true, ctx_length);
-		thread *thr_entropy = new thread(std::ref(*entropy));
+		if (line.size() < GR_PREFIX.size() + n_columns + 2 || 
+			!(equal(GR_PREFIX.begin(), GR_PREFIX.end(), line.begin()) || equal(GC_PREFIX.begin(), GC_PREFIX.end(), line.begin())))
+			continue;
 
-		// Push input sequences into the first queue
-		q_pre_transpose->Push(0, &v_sequences);
+		auto p = line.end() - n_columns;
+		if (p[-1] != ' ' || any_of(p, line.end(), [](uint8_t c) {return c == ' ' || c == '\t'; }))
+			continue;
 
-		q_pre_transpose->MarkCompleted();
+		if (v_annotations.empty())
+			v_meta_prefixes = v_meta;
 
-		thr_transpose->join();
-		thr_pbwt->join();
-		for (auto &x : v_thr_ss)
-			x->join();
-		thr_rle->join();
-		thr_entropy->join();
+		v_annotations.emplace_back(p, line.end());
+		v_meta_prefixes[i].resize(line.size() - n_columns);
+		v_annotated_lines.push_back(i - prev_line);
+		prev_line = i;
+	}
 
-		delete transpose;
-		delete thr_transpose;
+	if (v_annotations.size() * n_columns < ANNOTATION_MIN_SIZE)
+	{
+		v_annotations.clear();
+		return false;
+	}
 
-		delete pbwt;
-		delete thr_pbwt;
+	// Rows of the same feature (e.g., SS, PP) are grouped to make the columns more uniform
+	auto v_order = annotation_order(v_meta_prefixes);
+	vector<string> v_tmp(v_annotations.size());
+	for (size_t i = 0; i < v_order.size(); ++i)
+		v_tmp[i].swap(v_annotations[v_order[i]]);
+	v_annotations.swap(v_tmp);
 
-		for (int i = 0; i < n_thr_ss; ++i)
-		{
-			delete v_ss[i];
-			delete v_thr_ss[i];
-		}
+	// Own alphabet of annotations: the most frequent symbols are mapped onto the first ones of ANNOTATION_SYMBOLS
+	vector<pair<size_t, uint8_t>> v_counts(256);
+	for (int i = 0; i < 256; ++i)
+		v_counts[i].second = (uint8_t) i;
 
-		delete rle;
-		delete thr_rle;
+	for (auto &x : v_annotations)
+		for (auto c : x)
+			++v_counts[(uint8_t) c].first;
 
-		delete entropy;
-		delete thr_entropy;
+	sort(v_counts.begin(), v_counts.end(), [](const pair<size_t, uint8_t> &a, const pair<size_t, uint8_t> &b) {
+		return a.first != b.first ? a.first > b.first : a.second < b.second;
+	});
 
-		delete q_pre_transpose;
-		delete q_post_transpose;
-		delete q_post_PBWT;
-		delete q_post_SS;
-		delete q_post_RLE;
-		delete v_post_entropy;
+	v_annotation_alphabet.clear();
+	for (auto &x : v_counts)
+		if (x.first)
+			v_annotation_alphabet.push_back(x.second);
+
+	if (v_annotation_alphabet.size() > ANNOTATION_SYMBOLS.size())
+	{
+		v_annotations.clear();
+		return false;
+	}
+
+	uint8_t a_map[256];
+	for (size_t i = 0; i < v_annotation_alphabet.size(); ++i)
+		a_map[v_annotation_alphabet[i]] = (uint8_t) ANNOTATION_SYMBOLS[i];
+
+	for (auto &x : v_annotations)
+		for (auto &c : x)
+			c = (char) a_map[(uint8_t) c];
+
+	return true;
+}
+
+// *******************************************************************************************
+// Restore per-column annotations at the ends of their metadata lines
+bool CMSACompress::merge_annotations(vector<vector<uint8_t>> &v_meta)
+{
+	load_text(v_annotated_lines);
+	load_stream(v_annotation_alphabet);
+
+	if (v_annotated_lines.size() != v_annotations.size() || v_annotation_alphabet.size() > ANNOTATION_SYMBOLS.size())
+		return false;
+
+	uint8_t a_map[256] = { 0 };
+	for (size_t i = 0; i < v_annotation_alphabet.size(); ++i)
+		a_map[(uint8_t) ANNOTATION_SYMBOLS[i]] = v_annotation_alphabet[i];
+
+	for (auto &x : v_annotations)
+		for (auto &c : x)
+			c = (char) a_map[(uint8_t) c];
+
+	size_t line_no = 0;
+
+	for (auto x : v_annotated_lines)
+	{
+		line_no += x;
+		if (line_no >= v_meta.size())
+			return false;
+	}
+
+	auto v_order = annotation_order(v_meta);
+	vector<size_t> v_lines;
+	v_lines.reserve(v_annotated_lines.size());
+
+	line_no = 0;
+	for (auto x : v_annotated_lines)
+		v_lines.push_back(line_no += x);
+
+	for (size_t i = 0; i < v_order.size(); ++i)
+	{
+		auto &line = v_meta[v_lines[v_order[i]]];
+		line.insert(line.end(), v_annotations[i].begin(), v_annotations[i].end());
+	}
+
+	return true;
+}
+
+// *******************************************************************************************
+// Order of annotated lines (given by v_annotated_lines) grouped by their features, i.e., GR/GC and
+// the tag. It is computed from the line prefixes only, so the decompressor restores it without
+// any extra data.
+vector<size_t> CMSACompress::annotation_order(const vector<vector<uint8_t>> &v_meta)
+{
+	vector<string> v_keys;
+	v_keys.reserve(v_annotated_lines.size());
+
+	size_t line_no = 0;
+	for (auto x : v_annotated_lines)
+	{
+		auto &line = v_meta[line_no += x];
+		auto p = line.begin() + GR_PREFIX.size();
+
+		if (line[3] == 'R')			// skip sequence name
+		{
+			p = find(p, line.end(), ' ');
+			p = find_if(p, line.end(), [](uint8_t c) {return c != ' '; });
+		}
+
+		v_keys.emplace_back(1, (char) line[3]);
+		v_keys.back().append(p, find(p, line.end(), ' '));
+	}
+
+	vector<size_t> v_order(v_keys.size());
+	for (size_t i = 0; i < v_order.size(); ++i)
+		v_order[i] = i;
+
+	stable_sort(v_order.begin(), v_order.end(), [&](size_t a, size_t b) {return v_keys[a] < v_keys[b]; });
+
+	return v_order;
+}
+
+// *******************************************************************************************
+// Append names and metadata of Stockholm family to the metadata string. Per-column annotations
+// are moved to v_annotations (compressed as a separate matrix), only their lines are stored in text.
+void CMSACompress::append_stockholm_text(vector<vector<uint8_t>> &v_meta, vector<string> &v_names, vector<uint32_t> &v_offsets, vector<string> &v_sequences)
+{
+	gs_fields_used = gs_fields_mode;
+
+	if (annotation_rows_mode && !v_sequences.empty() && split_annotations(v_meta, v_sequences.front().size()))
+	{
+		append_family_text(v_meta_prefixes, v_names, v_offsets);
+		append_text(v_annotated_lines);
+		append_stream(v_annotation_alphabet);
 	}
 	else
-		pre_entropy_sequences_size = 0;
+	{
+		v_annotations.clear();
+		append_family_text(v_meta, v_names, v_offsets);
+	}
+}
+
+// *******************************************************************************************
+// Select context lengths from the size of the alignment (the entropy stage can refine them by trial coding)
+ctx_length_t CMSACompress::select_ctx_length(size_t file_size)
+{
+	if (file_size < 10000)
+		return ctx_length_t::tiny;		// 2, 1, 1
+	else if (file_size < 200000)
+		return ctx_length_t::small;		// 3, 2, 1
+	else if (file_size < 5000000)
+		return ctx_length_t::medium;		// 4, 2, 2
+	else if (file_size < 20000000)
+		return ctx_length_t::large;		// 5, 2, 2
+	else
+		return ctx_length_t::huge;		// 5, 3, 2
+}
+
+// *******************************************************************************************
+// Split the threads between LZMA of the text and the entropy stage. The LZMA thread is run next to
+// the pipeline of sequences, so only its extra threads for large texts are taken from the entropy stage.
+// Returns no. of LZMA threads
+int CMSACompress::split_threads(size_t text_size)
+{
+	int n_lzma_threads = 1;
+
+	if (text_size >= LZMA_MT_MIN_SIZE)
+		n_lzma_threads = max(1, n_threads / 2);
+
+	n_entropy_threads = max(1, n_threads - n_lzma_threads + 1);
+
+	return n_lzma_threads;
+}
+
+// *******************************************************************************************
+// Actual compression 
+bool CMSACompress::compress(vector<uint8_t> &v_text, vector<string> &v_sequences, uint32_t LZMA_mode, vector<uint8_t> &v_compressed_data,
+	size_t &comp_text_size, size_t &comp_seq_size, vector<string> *v_annotations)
+{
+	seq_block_t block, block_insert, block_annotations;
+	vector<uint8_t> v_column_classes;
+	uint32_t n_insert_columns = 0;
+	uint32_t n_annotation_rows = v_annotations ? (uint32_t) v_annotations->size() : 0;
+
+	size_t file_size = 0;
+
+	if(!v_sequences.empty())
+		file_size = v_sequences.size() * v_sequences.front().size();
+
+	// Text data - sequence names and (optional) metadata
+	v_text_compressed.clear();
+	int n_lzma_threads = split_threads(v_text.size());
+	text_dictionary_used = !v_text_dictionary.empty() && n_lzma_threads == 1;
+	CLZMAWrapper *lzma = new CLZMAWrapper(&v_text, &v_text_compressed, true, LZMA_mode, &lzma_streams, n_lzma_threads, 
+		text_dictionary_used ? &v_text_dictionary : nullptr);
+	thread *thr_lzma = new thread(std::ref(*lzma));
+
+	// Per-column annotations have their own alphabets, so they are compressed as a separate matrix
+	thread *thr_annotations = nullptr;
+	if (n_annotation_rows)
+		thr_annotations = new thread([&] {compress_matrix(*v_annotations, block_annotations); });
+
+	vector<bool> v_insert_columns;
+	vector<string> v_match, v_insert;
+
+	if (!file_size)
+		;
+	else if (sub_matrices_mode && file_size >= SUB_MATRICES_MIN_SIZE && split_columns(v_sequences, v_insert_columns, v_match, v_insert))
+	{
+		// Match and insert sub-matrices are compressed in parallel
+		thread thr_insert([&] {compress_matrix(v_insert, block_insert); });
+		compress_matrix(v_match, block);
+		encode_column_classes(v_insert_columns, v_column_classes);
+		thr_insert.join();
+
+		n_insert_columns = (uint32_t) v_insert.front().size();
+	}
+	else
+		compress_matrix(v_sequences, block);
 
 	thr_lzma->join();
 
 	delete lzma;
 	delete thr_lzma;
 
-	store_data_in_stream(ctx_length, fast_variant, v_seq_compressed, v_text_compressed, pre_entropy_sequences_size, 
-		(uint32_t) v_sequences.size(), pre_entropy_sequences_size ? (uint32_t) v_sequences.front().size(): 0, v_compressed_data);
+	if (thr_annotations)
+	{
+		thr_annotations->join();
+		delete thr_annotations;
+	}
+
+	store_data_in_stream(block, block_insert, block_annotations, v_column_classes, v_text_compressed, (uint32_t) v_sequences.size(), 
+		file_size ? (uint32_t) v_sequences.front().size() : 0, n_insert_columns, n_annotation_rows, v_compressed_data);
 
-	comp_text_size = v_text_compressed.size();
-	comp_seq_size = v_seq_compressed.size();
+	comp_text_size = v_text_compressed.size() + block_annotations.size();
+	comp_seq_size = block.size() + block_insert.size() + v_column_classes.size();
+
+	return true;
+}
+
+// *******************************************************************************************
+// Compression of the (sub)matrix with the context lengths and the second stage selected for it
+void CMSACompress::compress_matrix(vector<string> &v_sequences, seq_block_t &block)
+{
+	size_t file_size = v_sequences.size() * v_sequences.front().size();
+
+	block.ctx_length = select_ctx_length(file_size);
+	block.fast_variant = second_stage == second_stage_t::mtf;
+
+	if (second_stage == second_stage_t::automatic && file_size >= AUTO_MIN_TRIAL_SIZE)
+		block.fast_variant = sample_trial(v_sequences, block.ctx_length);
+
+	compress_sequences(v_sequences, block);
+}
+
+// *******************************************************************************************
+// Split alignment into match and insert columns. In Stockholm files insert columns contain 
+// only '.' and lowercase letters.
+// Returns false if all columns are of the same kind
+bool CMSACompress::split_columns(vector<string> &v_sequences, vector<bool> &v_insert_columns, vector<string> &v_match, vector<string> &v_insert)
+{
+	size_t n_columns = v_sequences.front().size();
+	vector<uint8_t> v_match_symbol(n_columns, 0);
+
+	for (auto &x : v_sequences)
+	{
+		if (x.size() != n_columns)
+			return false;
+
+		for (size_t i = 0; i < n_columns; ++i)
+			v_match_symbol[i] |= !(x[i] == '.' || (x[i] >= 'a' && x[i] <= 'z'));
+	}
+
+	v_insert_columns.resize(n_columns);
+
+	size_t n_insert_columns = 0;
+	for (size_t i = 0; i < n_columns; ++i)
+	{
+		v_insert_columns[i] = !v_match_symbol[i];
+		n_insert_columns += v_insert_columns[i];
+	}
+
+	if (n_insert_columns == 0 || n_insert_columns == n_columns)
+		return false;
+
+	v_match.resize(v_sequences.size());
+	v_insert.resize(v_sequences.size());
+
+	for (size_t j = 0; j < v_sequences.size(); ++j)
+	{
+		auto &x = v_sequences[j];
+		string &match = v_match[j];
+		string &insert = v_insert[j];
+
+		match.reserve(n_columns - n_insert_columns);
+		insert.reserve(n_insert_columns);
+
+		for (size_t i = 0; i < n_columns; ++i)
+			if (v_insert_columns[i])
+				insert.push_back(x[i]);
+			else
+				match.push_back(x[i]);
+	}
 
 	return true;
 }
 
+// *******************************************************************************************
+// Interleave match and insert columns 
+void CMSACompress::merge_columns(vector<bool> &v_insert_columns, vector<string> &v_match, vector<string> &v_insert, vector<string> &v_sequences)
+{
+	size_t n_columns = v_insert_columns.size();
+
+	v_sequences.resize(v_match.size());
+
+	for (size_t j = 0; j < v_match.size(); ++j)
+	{
+		string &x = v_sequences[j];
+		const char *p_match = v_match[j].data();
+		const char *p_insert = v_insert[j].data();
+
+		x.resize(n_columns);
+
+		for (size_t i = 0; i < n_columns; ++i)
+			x[i] = v_insert_columns[i] ? *p_insert++ : *p_match++;
+
+		string().swap(v_match[j]);
+		string().swap(v_insert[j]);
+	}
+}
+
+// *******************************************************************************************
+// Encode column classes (match/insert) - the context are classes of 4 previous columns
+void CMSACompress::encode_column_classes(vector<bool> &v_insert_columns, vector<uint8_t> &v_compressed)
+{
+	v_compressed.clear();
+
+	CVectorIOStream vios(v_compressed);
+	CRangeEncoder<CVectorIOStream> rce(vios);
+	vector<CRangeCoderModel<CVectorIOStream> *> v_rc(16);
+
+	for (auto &x : v_rc)
+		x = new CRangeCoderModel<CVectorIOStream>(&rce, 2, 10, 1 << 10, nullptr, true);
+
+	rce.Start();
+
+	uint32_t ctx = 0;
+	for (auto x : v_insert_columns)
+	{
+		v_rc[ctx]->Encode(x);
+		ctx = ((ctx << 1) + x) & 15;
+	}
+
+	rce.End();
+
+	for (auto &x : v_rc)
+		delete x;
+}
+
+// *******************************************************************************************
+// Decode column classes (match/insert)
+void CMSACompress::decode_column_classes(vector<uint8_t> &v_compressed, uint32_t n_columns, vector<bool> &v_insert_columns)
+{
+	CVectorIOStream vios(v_compressed);
+	CRangeDecoder<CVectorIOStream> rcd(vios);
+	vector<CRangeCoderModel<CVectorIOStream> *> v_rc(16);
+
+	for (auto &x : v_rc)
+		x = new CRangeCoderModel<CVectorIOStream>(&rcd, 2, 10, 1 << 10, nullptr, false);
+
+	rcd.Start();
+
+	v_insert_columns.resize(n_columns);
+
+	uint32_t ctx = 0;
+	for (uint32_t i = 0; i < n_columns; ++i)
+	{
+		bool x = v_rc[ctx]->Decode() != 0;
+		v_insert_columns[i] = x;
+		ctx = ((ctx << 1) + x) & 15;
+	}
+
+	rcd.End();
+
+	for (auto &x : v_rc)
+		delete x;
+}
+
+// *******************************************************************************************
+// Select the entropy backend and its modes for the stream of n_symbols symbols
+// Returns the size of entropy coded blocks (0 for a single stream)
+size_t CMSACompress::configure_entropy(seq_block_t &block, size_t n_symbols)
+{
+	entropy_backend_t backend = entropy_backend;
+	if (backend == entropy_backend_t::huffman && n_symbols < HUFFMAN_MIN_SIZE)
+		backend = entropy_backend_t::range_coder;
+
+	block.run_lengths = run_lengths_mode && backend != entropy_backend_t::huffman && RLE0_fwd_mode == stage_mode_t::forward &&
+		n_symbols >= RUN_LENGTHS_MIN_SIZE;
+
+	// Huffman encoder buffers the symbols of the whole stream, so it is always used in the block mode
+	size_t block_size = entropy_block_size;
+	if (backend != entropy_backend_t::range_coder && !block_size)
+		block_size = ENTROPY_BLOCK_SIZE;
+
+	// A stream that fits in a single block is coded without the index of blocks
+	if (backend == entropy_backend_t::range_coder && n_symbols <= block_size)
+		block_size = 0;
+
+	block.entropy_blocks = block_size != 0;
+	block.entropy_backend = backend;
+
+	return block_size;
+}
+
+// *******************************************************************************************
+// Parameters of the entropy stage for the block (in the decompression block_size is given by the entropy_blocks flag)
+entropy_params_t CMSACompress::entropy_params(const seq_block_t &block, size_t block_size)
+{
+	entropy_params_t params;
+
+	params.ctx_length = block.ctx_length;
+	params.block_size = block_size;
+	params.backend = block.entropy_backend;
+	params.run_lengths = block.run_lengths;
+
+	return params;
+}
+
+// *******************************************************************************************
+// Compression of the alignment (transposition, gPBWT, MTF/WFC, RLE-0, entropy coding)
+// If ctx_trial is set, the context lengths can be changed by the entropy stage
+// If v_columns is given, the entropy stage is skipped and the columns coming to it are returned there
+void CMSACompress::compress_sequences(vector<string> &v_sequences, seq_block_t &block, bool ctx_trial, vector<string> *v_columns)
+{
+	// Queues
+#ifdef _DEBUG
+	int n_thr_ss = 1;
+#else
+	int n_thr_ss = block.fast_variant ? 2 : 4;	
+#endif
+
+	block.v_data.clear();
+	block.v_column_info.clear();
+	block.v_gap_mask.clear();
+
+	// Side info is not stored for families of a super-block (v_columns given)
+	CColumnInfo *column_info = nullptr;
+	if (column_info_mode && !v_columns && PBWT_fwd_mode == stage_mode_t::forward && v_sequences.size() * v_sequences.front().size() >= COLUMN_INFO_MIN_SIZE)
+		column_info = new CColumnInfo();
+
+	CGapMask *gap_mask = nullptr;
+	if (gap_mask_mode && !v_columns && PBWT_fwd_mode == stage_mode_t::forward && v_sequences.size() * v_sequences.front().size() >= GAP_MASK_MIN_SIZE)
+		gap_mask = new CGapMask();
+
+	// Sequence data
+	CRegisteringPriorityQueue<vector<string> *> *q_pre_transpose = new CRegisteringPriorityQueue<vector<string> *>(1);
+	CRegisteringPriorityQueue<string> *q_post_transpose = new CRegisteringPriorityQueue<string>(1);
+	CRegisteringPriorityQueue<string> *q_post_PBWT = new CRegisteringPriorityQueue<string>(1);
+	CRegisteringPriorityQueue<string> *q_post_SS = new CRegisteringPriorityQueue<string>(n_thr_ss);
+	CRegisteringPriorityQueue<string> *q_post_RLE = new CRegisteringPriorityQueue<string>(1);
+	CVectorIOStream *v_post_entropy = new CVectorIOStream(block.v_data);
+
+	// Transpose
+	CTranspose *transpose = new CTranspose(q_pre_transpose, q_post_transpose, 0, 0, Transpose_fwd_mode);
+	thread *thr_transpose = new thread(std::ref(*transpose));
+
+	// PBWT
+	CPBWT *pbwt = new CPBWT(q_post_transpose, q_post_PBWT, PBWT_fwd_mode, column_info, gap_mask);
+	thread *thr_pbwt = new thread(std::ref(*pbwt));
+
+	vector<CSecondStage *> v_ss(n_thr_ss);
+	vector<thread *> v_thr_ss(n_thr_ss);
+
+	if (block.fast_variant)
+	{
+		// MTF
+		for (int i = 0; i < n_thr_ss; ++i)
+		{
+			v_ss[i] = new CMTF(q_post_PBWT, q_post_SS, SS_fwd_mode);
+			v_thr_ss[i] = new thread(std::ref(*(v_ss[i])));
+		}
+	}
+	else
+	{
+		// WFC
+		for (int i = 0; i < n_thr_ss; ++i)
+		{
+			v_ss[i] = new CWFC(q_post_PBWT, q_post_SS, SS_fwd_mode);
+			v_thr_ss[i] = new thread(std::ref(*(v_ss[i])));
+		}
+	}
+
+	size_t block_size = configure_entropy(block, v_sequences.size() * v_sequences.front().size());
+
+	// RLE-0 (unless zero-runs are coded by the entropy coder)
+	CRLE *rle = nullptr;
+	thread *thr_rle = nullptr;
+	if (!block.run_lengths)
+	{
+		rle = new CRLE(q_post_SS, q_post_RLE, RLE0_fwd_mode);
+		thr_rle = new thread(std::ref(*rle));
+	}
+
+	// Entropy
+	CEntropy *entropy = nullptr;
+	thread *thr_entropy = nullptr;
+	if (!v_columns)
+	{
+		entropy_params_t params = entropy_params(block, block_size);
+		params.select_ctx = ctx_trial && ctx_trial_mode && block.entropy_backend != entropy_backend_t::huffman;
+
+		entropy = new CEntropy(block.run_lengths ? q_post_SS : q_post_RLE, v_post_entropy, block.pre_entropy_size, 0, true, params, n_entropy_threads, nullptr, &entropy_coder_pool);
+		thr_entropy = new thread(std::ref(*entropy));
+	}
+
+	// Push input sequences into the first queue
+	q_pre_transpose->Push(0, &v_sequences);
+
+	q_pre_transpose->MarkCompleted();
+
+	thr_transpose->join();
+	thr_pbwt->join();
+	for (auto &x : v_thr_ss)
+		x->join();
+	if (thr_rle)
+		thr_rle->join();
+
+	if (entropy)
+	{
+		thr_entropy->join();
+		block.ctx_length = entropy->GetCtxLength();
+	}
+	else
+	{
+		CRegisteringPriorityQueue<string> *q_columns = block.run_lengths ? q_post_SS : q_post_RLE;
+		uint64_t priority;
+		string column;
+
+		v_columns->clear();
+		while (q_columns->Pop(priority, column))
+			v_columns->emplace_back(move(column));
+	}
+
+	// If all columns are regular, the sequence data are exactly the same as without column info
+	if (column_info && column_info->NoRegular() < column_info->Size())
+		column_info->Encode(block.v_column_info, (uint32_t) (Transpose_fwd_mode == stage_mode_t::forward ? v_sequences.size() : v_sequences.front().size()));
+
+	delete column_info;
+
+	if (gap_mask)
+		gap_mask->Encode(block.v_gap_mask);
+
+	delete gap_mask;
+
+	delete transpose;
+	delete thr_transpose;
+
+	delete pbwt;
+	delete thr_pbwt;
+
+	for (int i = 0; i < n_thr_ss; ++i)
+	{
+		delete v_ss[i];
+		delete v_thr_ss[i];
+	}
+
+	delete rle;
+	delete thr_rle;
+
+	delete entropy;
+	delete thr_entropy;
+
+	delete q_pre_transpose;
+	delete q_post_transpose;
+	delete q_post_PBWT;
+	delete q_post_SS;
+	delete q_post_RLE;
+	delete v_post_entropy;
+}
+
+// *******************************************************************************************
+// Check whether the gain of WFC over MTF is worth its (much higher) cost
+bool CMSACompress::wfc_pays_off(size_t size_mtf, size_t size_wfc)
+{
+	return size_wfc < size_mtf * (1.0 - AUTO_MIN_WFC_GAIN);
+}
+
+// *******************************************************************************************
+// Automatic selection of the second stage - both variants are run in parallel on a block of columns
+// from the middle of the alignment
+// Returns true if MTF should be used
+bool CMSACompress::sample_trial(vector<string> &v_sequences, ctx_length_t ctx_length)
+{
+	size_t n_columns = v_sequences.front().size();
+	size_t n_sample_columns = max(AUTO_MIN_SAMPLE_COLUMNS, min(n_columns / AUTO_SAMPLE_FRACTION, AUTO_SAMPLE_SIZE / v_sequences.size()));
+
+	if (n_sample_columns > n_columns)
+		n_sample_columns = n_columns;
+
+	size_t first_column = (n_columns - n_sample_columns) / 2;
+
+	vector<string> v_sample;
+	v_sample.reserve(v_sequences.size());
+
+	for (auto &x : v_sequences)
+		v_sample.emplace_back(x, first_column, n_sample_columns);
+
+	seq_block_t block_mtf, block_wfc;
+
+	block_mtf.ctx_length = block_wfc.ctx_length = ctx_length;
+	block_mtf.fast_variant = true;
+	block_wfc.fast_variant = false;
+
+	thread thr_mtf([&] {compress_sequences(v_sample, block_mtf, false); });
+	compress_sequences(v_sample, block_wfc, false);
+	thr_mtf.join();
+
+	return !wfc_pays_off(block_mtf.size(), block_wfc.size());
+}
+
+// *******************************************************************************************
+// Compression of the families of super-block with the second stage given in the block.
+// The columns of all families are coded by a single entropy coder.
+void CMSACompress::compress_super_block(vector<msa_family_t> &v_families, seq_block_t &block)
+{
+	vector<string> v_columns, v_family_columns;
+	size_t n_symbols = 0;
+
+	for (auto &x : v_families)
+	{
+		if (!x.size())
+			continue;
+
+		seq_block_t family_block = block;
+
+		compress_sequences(x.v_sequences, family_block, false, &v_family_columns);
+		n_symbols += x.size();
+
+		for (auto &y : v_family_columns)
+			v_columns.emplace_back(move(y));
+	}
+
+	block.ctx_length = select_ctx_length(n_symbols);
+	size_t block_size = configure_entropy(block, n_symbols);
+	block.run_lengths = false;			// zero-runs of tiny families are always coded by RLE-0
+
+	CRegisteringPriorityQueue<string> *q_post_RLE = new CRegisteringPriorityQueue<string>(1);
+	for (size_t i = 0; i < v_columns.size(); ++i)
+		q_post_RLE->Push(i, move(v_columns[i]));
+	q_post_RLE->MarkCompleted();
+
+	block.v_data.clear();
+	CVectorIOStream *v_post_entropy = new CVectorIOStream(block.v_data);
+
+	entropy_params_t params = entropy_params(block, block_size);
+	params.select_ctx = ctx_trial_mode && block.entropy_backend != entropy_backend_t::huffman;
+
+	CEntropy *entropy = new CEntropy(q_post_RLE, v_post_entropy, block.pre_entropy_size, 0, true, params, n_entropy_threads, nullptr, &entropy_coder_pool);
+	(*entropy)();
+
+	block.ctx_length = entropy->GetCtxLength();
+
+	delete entropy;
+	delete v_post_entropy;
+	delete q_post_RLE;
+}
+
+// *******************************************************************************************
+// Extended flags describing the parts of the block
+uint32_t CMSACompress::block_flags(seq_block_t &block)
+{
+	uint32_t flags = 0;
+
+	if (!block.v_column_info.empty())
+		flags |= EXT_FLAG_COLUMN_INFO;
+	if (!block.v_gap_mask.empty())
+		flags |= EXT_FLAG_GAP_MASK;
+	if (block.entropy_blocks)
+		flags |= EXT_FLAG_ENTROPY_BLOCKS;
+	if (block.entropy_backend == entropy_backend_t::huffman)
+		flags |= EXT_FLAG_HUFFMAN;
+	if (block.run_lengths)
+		flags |= EXT_FLAG_RUN_LENGTHS;
+
+	return flags;
+}
+
+// *******************************************************************************************
+// Store sizes of the parts of the block
+void CMSACompress::store_block_sizes(seq_block_t &block, uint32_t flags, vector<uint8_t> &v_compressed_data)
+{
+	store_uint(v_compressed_data, block.v_data.size());
+	store_uint(v_compressed_data, block.pre_entropy_size);
+	if (flags & EXT_FLAG_COLUMN_INFO)
+		store_uint(v_compressed_data, block.v_column_info.size());
+	if (flags & EXT_FLAG_GAP_MASK)
+		store_uint(v_compressed_data, block.v_gap_mask.size());
+}
+
+// *******************************************************************************************
+// Load sizes of the parts of the block and make room for them
+void CMSACompress::load_block_sizes(seq_block_t &block, uint32_t flags, vector<uint8_t> &v_compressed_data, size_t &vu_pos)
+{
+	block.entropy_blocks = (flags & EXT_FLAG_ENTROPY_BLOCKS) != 0;
+	block.entropy_backend = (flags & EXT_FLAG_HUFFMAN) ? entropy_backend_t::huffman : entropy_backend_t::range_coder;
+	block.run_lengths = (flags & EXT_FLAG_RUN_LENGTHS) != 0;
+	block.v_data.resize(load_uint(v_compressed_data, vu_pos));
+	block.pre_entropy_size = load_uint(v_compressed_data, vu_pos);
+	block.v_column_info.resize((flags & EXT_FLAG_COLUMN_INFO) ? load_uint(v_compressed_data, vu_pos) : 0);
+	block.v_gap_mask.resize((flags & EXT_FLAG_GAP_MASK) ? load_uint(v_compressed_data, vu_pos) : 0);
+}
+
+// *******************************************************************************************
+void CMSACompress::store_block_data(seq_block_t &block, vector<uint8_t> &v_compressed_data)
+{
+	v_compressed_data.insert(v_compressed_data.end(), block.v_column_info.begin(), block.v_column_info.end());
+	v_compressed_data.insert(v_compressed_data.end(), block.v_gap_mask.begin(), block.v_gap_mask.end());
+	v_compressed_data.insert(v_compressed_data.end(), block.v_data.begin(), block.v_data.end());
+}
+
+// *******************************************************************************************
+void CMSACompress::load_block_data(seq_block_t &block, vector<uint8_t> &v_compressed_data, size_t &vu_pos)
+{
+	for (auto v : { &block.v_column_info, &block.v_gap_mask, &block.v_data })
+	{
+		copy_n(v_compressed_data.data() + vu_pos, v->size(), v->data());
+		vu_pos += v->size();
+	}
+}
+
 // *******************************************************************************************
 // Store some extra values in the compressed stream
-void CMSACompress::store_data_in_stream(ctx_length_t ctx_length, bool fast_variant, vector<uint8_t> &v_seq_compressed, vector<uint8_t> &v_text_compressed, size_t pre_entropy_sequences_size,
-	uint32_t n_sequences, uint32_t n_columns, vector<uint8_t> &v_compressed_data)
+void CMSACompress::store_data_in_stream(seq_block_t &block, seq_block_t &block_insert, seq_block_t &block_annotations, vector<uint8_t> &v_column_classes, 
+	vector<uint8_t> &v_text_compressed, uint32_t n_sequences, uint32_t n_columns, uint32_t n_insert_columns, uint32_t n_annotation_rows, 
+	vector<uint8_t> &v_compressed_data)
 {
+	uint32_t ext_flags = block_flags(block);
+
+	if (!v_column_classes.empty())
+		ext_flags |= EXT_FLAG_SUB_MATRICES;
+	if (text_dictionary_used)
+		ext_flags |= EXT_FLAG_TEXT_DICTIONARY;
+	if (gs_fields_used)
+		ext_flags |= EXT_FLAG_GS_FIELDS;
+	if (n_annotation_rows)
+		ext_flags |= EXT_FLAG_ANNOTATION_ROWS;
+
 	v_compressed_data.clear();
 
-	v_compressed_data.reserve(1 + 4 * sizeof(size_t) + v_seq_compressed.size() + v_text_compressed.size());
+	v_compressed_data.reserve(2 + 16 * sizeof(size_t) + block.size() + block_insert.size() + block_annotations.size() + v_column_classes.size() + v_text_compressed.size());
+
+	v_compressed_data.push_back((uint8_t)block.ctx_length + (block.fast_variant ? FAMILY_FLAG_FAST_VARIANT : 0) + (ext_flags ? FAMILY_FLAG_EXTENDED : 0));
+	if (ext_flags)
+		store_uint(v_compressed_data, ext_flags);
 
-	v_compressed_data.push_back((uint8_t)ctx_length + (fast_variant ? 64 : 0));
 	store_uint(v_compressed_data, (size_t)n_sequences);
 	store_uint(v_compressed_data, (size_t)n_columns);
 	store_uint(v_compressed_data, v_text_compressed.size());
-	store_uint(v_compressed_data, v_seq_compressed.size());
-	store_uint(v_compressed_data, pre_entropy_sequences_size);
+	store_block_sizes(block, ext_flags, v_compressed_data);
+
+	if (ext_flags & EXT_FLAG_SUB_MATRICES)
+	{
+		uint32_t insert_flags = block_flags(block_insert);
+
+		v_compressed_data.push_back((uint8_t)block_insert.ctx_length + (block_insert.fast_variant ? FAMILY_FLAG_FAST_VARIANT : 0));
+		store_uint(v_compressed_data, insert_flags);
+		store_uint(v_compressed_data, (size_t)n_insert_columns);
+		store_uint(v_compressed_data, v_column_classes.size());
+		store_block_sizes(block_insert, insert_flags, v_compressed_data);
+	}
+
+	if (ext_flags & EXT_FLAG_ANNOTATION_ROWS)
+	{
+		uint32_t annotations_flags = block_flags(block_annotations);
+
+		v_compressed_data.push_back((uint8_t)block_annotations.ctx_length + (block_annotations.fast_variant ? FAMILY_FLAG_FAST_VARIANT : 0));
+		store_uint(v_compressed_data, annotations_flags);
+		store_uint(v_compressed_data, (size_t)n_annotation_rows);
+		store_block_sizes(block_annotations, annotations_flags, v_compressed_data);
+	}
 
 	v_compressed_data.insert(v_compressed_data.end(), v_text_compressed.begin(), v_text_compressed.end());
-	v_compressed_data.insert(v_compressed_data.end(), v_seq_compressed.begin(), v_seq_compressed.end());
+	store_block_data(block, v_compressed_data);
+
+	if (ext_flags & EXT_FLAG_SUB_MATRICES)
+	{
+		v_compressed_data.insert(v_compressed_data.end(), v_column_classes.begin(), v_column_classes.end());
+		store_block_data(block_insert, v_compressed_data);
+	}
+
+	if (ext_flags & EXT_FLAG_ANNOTATION_ROWS)
+		store_block_data(block_annotations, v_compressed_data);
 }
 
 // *******************************************************************************************
 // Load some extra values from the compressed stream
-void CMSACompress::load_data_from_stream(ctx_length_t &ctx_length, bool &fast_variant, vector<uint8_t> &v_seq_compressed, vector<uint8_t> &v_text_compressed, size_t &pre_entropy_sequences_size, 
-	uint32_t &n_sequences, uint32_t &n_columns, vector<uint8_t> &v_compressed_data)
+void CMSACompress::load_data_from_stream(seq_block_t &block, seq_block_t &block_insert, seq_block_t &block_annotations, vector<uint8_t> &v_column_classes, 
+	vector<uint8_t> &v_text_compressed, uint32_t &n_sequences, uint32_t &n_columns, uint32_t &n_insert_columns, uint32_t &n_annotation_rows, 
+	vector<uint8_t> &v_compressed_data)
 {
 	size_t vu_pos = 0;
 
 	uint8_t t = v_compressed_data[vu_pos++];
+	uint32_t ext_flags = 0;
 
-	if (t & 64)
+	if (t & FAMILY_FLAG_EXTENDED)
 	{
-		fast_variant = true;
-		t -= 64;
+		ext_flags = (uint32_t) load_uint(v_compressed_data, vu_pos);
+		t -= FAMILY_FLAG_EXTENDED;
+	}
+
+	if (t & FAMILY_FLAG_FAST_VARIANT)
+	{
+		block.fast_variant = true;
+		t -= FAMILY_FLAG_FAST_VARIANT;
 	}
 	else
-		fast_variant = false;
-	ctx_length = (ctx_length_t)t;
+		block.fast_variant = false;
+	block.ctx_length = (ctx_length_t)t;
+
+	text_dictionary_used = (ext_flags & EXT_FLAG_TEXT_DICTIONARY) != 0;
+	gs_fields_used = (ext_flags & EXT_FLAG_GS_FIELDS) != 0;
 
 	n_sequences = (uint32_t) load_uint(v_compressed_data, vu_pos);
 	n_columns = (uint32_t) load_uint(v_compressed_data, vu_pos);
-	size_t v_text_compressed_size = load_uint(v_compressed_data, vu_pos);
-	size_t v_seq_compressed_size = load_uint(v_compressed_data, vu_pos);
-	pre_entropy_sequences_size = load_uint(v_compressed_data, vu_pos);
+	v_text_compressed.resize(load_uint(v_compressed_data, vu_pos));
+	load_block_sizes(block, ext_flags, v_compressed_data, vu_pos);
+
+	n_insert_columns = 0;
+	v_column_classes.clear();
+
+	if (ext_flags & EXT_FLAG_SUB_MATRICES)
+	{
+		t = v_compressed_data[vu_pos++];
+		block_insert.fast_variant = (t & FAMILY_FLAG_FAST_VARIANT) != 0;
+		block_insert.ctx_length = (ctx_length_t) (t & ~FAMILY_FLAG_FAST_VARIANT);
+
+		uint32_t insert_flags = (uint32_t) load_uint(v_compressed_data, vu_pos);
+		n_insert_columns = (uint32_t) load_uint(v_compressed_data, vu_pos);
+		v_column_classes.resize(load_uint(v_compressed_data, vu_pos));
+		load_block_sizes(block_insert, insert_flags, v_compressed_data, vu_pos);
+	}
 
-	v_text_compressed.resize(v_text_compressed_size);
-	v_seq_compressed.resize(v_seq_compressed_size);
+	n_annotation_rows = 0;
 
-	copy_n(v_compressed_data.data() + vu_pos, v_text_compressed_size, v_text_compressed.data());
-	vu_pos += v_text_compressed_size;
-	copy_n(v_compressed_data.data() + vu_pos, v_seq_compressed_size, v_seq_compressed.data());
+	if (ext_flags & EXT_FLAG_ANNOTATION_ROWS)
+	{
+		t = v_compressed_data[vu_pos++];
+		block_annotations.fast_variant = (t & FAMILY_FLAG_FAST_VARIANT) != 0;
+		block_annotations.ctx_length = (ctx_length_t) (t & ~FAMILY_FLAG_FAST_VARIANT);
+
+		uint32_t annotations_flags = (uint32_t) load_uint(v_compressed_data, vu_pos);
+		n_annotation_rows = (uint32_t) load_uint(v_compressed_data, vu_pos);
+		load_block_sizes(block_annotations, annotations_flags, v_compressed_data, vu_pos);
+	}
+
+	copy_n(v_compressed_data.data() + vu_pos, v_text_compressed.size(), v_text_compressed.data());
+	vu_pos += v_text_compressed.size();
+	load_block_data(block, v_compressed_data, vu_pos);
+
+	if (ext_flags & EXT_FLAG_SUB_MATRICES)
+	{
+		copy_n(v_compressed_data.data() + vu_pos, v_column_classes.size(), v_column_classes.data());
+		vu_pos += v_column_classes.size();
+		load_block_data(block_insert, v_compressed_data, vu_pos);
+	}
+
+	if (ext_flags & EXT_FLAG_ANNOTATION_ROWS)
+		load_block_data(block_annotations, v_compressed_data, vu_pos);
 }
 
 // *******************************************************************************************
@@ -478,6 +1659,13 @@ size_t CMSACompress::load_uint(vector<uint8_t> &vu, size_t &vu_pos)
 	uint32_t shift = 0;
 	size_t x = 0;
 
+	// On corrupted data nothing is read and vu_pos is moved past the end of vu (to be checked by the caller)
+	if (vu_pos >= vu.size() || vu[vu_pos] > sizeof(size_t) || vu[vu_pos] >= vu.size() - vu_pos)
+	{
+		vu_pos = vu.size() + 1;
+		return 0;
+	}
+
 	uint32_t n_bytes = vu[vu_pos++];
 
 	for (uint32_t i = 0; i < n_bytes; ++i)
@@ -491,122 +1679,257 @@ size_t CMSACompress::load_uint(vector<uint8_t> &vu, size_t &vu_pos)
 
 // *******************************************************************************************
 // Actual decompression
-bool CMSACompress::decompress(vector<uint8_t> &v_text, vector<string> &v_sequences, vector<uint8_t> &v_compressed_data)
+bool CMSACompress::decompress(vector<uint8_t> &v_text, vector<string> &v_sequences, vector<uint8_t> &v_compressed_data, vector<string> *v_annotations)
 {
 	vector<uint8_t> v_text_compressed;
-	vector<uint8_t> v_seq_compressed;
+	vector<uint8_t> v_column_classes;
+	seq_block_t block, block_insert, block_annotations;
 
-	size_t pre_entropy_sequences_size;
 	uint32_t n_sequences;
 	uint32_t n_columns;
-	ctx_length_t ctx_length;
+	uint32_t n_insert_columns;
+	uint32_t n_annotation_rows;
+
+	load_data_from_stream(block, block_insert, block_annotations, v_column_classes, v_text_compressed, n_sequences, n_columns, n_insert_columns, 
+		n_annotation_rows, v_compressed_data);
 
-	load_data_from_stream(ctx_length, fast_variant, v_seq_compressed, v_text_compressed, pre_entropy_sequences_size, n_sequences, n_columns, v_compressed_data);
+	if (n_annotation_rows && !v_annotations)
+	{
+		cerr << "Unexpected per-column annotations\n";
+		return false;
+	}
+
+	if (text_dictionary_used && v_text_dictionary.empty())
+	{
+		cerr << "No preset dictionary of metadata\n";
+		return false;
+	}
 
+	// Names and meta
+	CLZMAWrapper *lzma = new CLZMAWrapper(&v_text, &v_text_compressed, false, 0, &lzma_streams, 1, 
+		text_dictionary_used ? &v_text_dictionary : nullptr);
+	thread *thr_lzma = new thread(std::ref(*lzma));
+
+	bool annotations_ok = true;
+	bool insert_ok = true;
+	bool match_ok = true;
+
+	thread *thr_annotations = nullptr;
+	if (v_annotations)
+	{
+		v_annotations->clear();
+		if (n_annotation_rows)
+			thr_annotations = new thread([&] {annotations_ok = decompress_sequences(block_annotations, n_annotation_rows, n_columns, *v_annotations); });
+	}
+
+	if (!n_sequences || !n_columns)
+		v_sequences.clear();
+	else if (n_insert_columns)
+	{
+		vector<bool> v_insert_columns;
+		vector<string> v_match, v_insert;
+
+		thread thr_insert([&] {insert_ok = decompress_sequences(block_insert, n_sequences, n_insert_columns, v_insert); });
+		match_ok = decompress_sequences(block, n_sequences, n_columns - n_insert_columns, v_match);
+		decode_column_classes(v_column_classes, n_columns, v_insert_columns);
+		thr_insert.join();
+
+		if (match_ok && insert_ok)
+			merge_columns(v_insert_columns, v_match, v_insert, v_sequences);
+	}
+	else
+		match_ok = decompress_sequences(block, n_sequences, n_columns, v_sequences);
+
+	thr_lzma->join();
+	bool text_ok = lzma->Success();
+	delete lzma;
+	delete thr_lzma;
+
+	if (thr_annotations)
+	{
+		thr_annotations->join();
+		delete thr_annotations;
+	}
+
+	if (!text_ok)
+		cerr << "Corrupted names and metadata\n";
+
+	return text_ok && annotations_ok && insert_ok && match_ok;
+}
+
+// *******************************************************************************************
+// Decompression of the alignment
+// If v_columns is given, the entropy stage is skipped and the columns are taken from there
+// Returns false for corrupted descriptions of columns or gap mask
+bool CMSACompress::decompress_sequences(seq_block_t &block, uint32_t n_sequences, uint32_t n_columns, vector<string> &v_sequences, vector<string> *v_columns)
+{
 #ifdef _DEBUG
 	int n_thr_ss = 1;
 #else
-	int n_thr_ss = fast_variant ? 2 : 4;
+	int n_thr_ss = block.fast_variant ? 2 : 4;
 #endif
 
-	// Names and meta
-	CLZMAWrapper *lzma = new CLZMAWrapper(&v_text, &v_text_compressed, false, 0);
-	thread *thr_lzma = new thread(std::ref(*lzma));
+	// Length and number of vectors processed by the stages after transposition
+	uint32_t vec_len = Transpose_rev_mode == stage_mode_t::reverse ? n_sequences : n_columns;
+	uint32_t n_vecs = Transpose_rev_mode == stage_mode_t::reverse ? n_columns : n_sequences;
 
-	if (pre_entropy_sequences_size)
+	CColumnInfo *column_info = nullptr;
+	if (!block.v_column_info.empty())
 	{
-		CVectorIOStream *v_pre_entropy = new CVectorIOStream(v_seq_compressed);
-		CRegisteringPriorityQueue<string> *q_post_entropy = new CRegisteringPriorityQueue<string>(1);
-		CRegisteringPriorityQueue<string> *q_post_RLE = new CRegisteringPriorityQueue<string>(1);
-		CRegisteringPriorityQueue<string> *q_post_SS = new CRegisteringPriorityQueue<string>(n_thr_ss);
-		CRegisteringPriorityQueue<string> *q_post_PBWT = new CRegisteringPriorityQueue<string>(1);
-		CRegisteringPriorityQueue<vector<string> *> *q_post_transpose = new CRegisteringPriorityQueue<vector<string> *>(1);
+		column_info = new CColumnInfo();
+		if (!column_info->Decode(block.v_column_info, vec_len, n_vecs))
+		{
+			cerr << "Corrupted description of columns\n";
+			delete column_info;
+			return false;
+		}
+	}
 
-		// Entropy
-		CEntropy *entropy = new CEntropy(q_post_entropy, v_pre_entropy, pre_entropy_sequences_size, Transpose_fwd_mode == stage_mode_t::forward ? n_sequences : n_columns, false, ctx_length);
-		thread *thr_entropy = new thread(std::ref(*entropy));
+	// Lengths of columns coming from the entropy decoder are given by the gap mask
+	CGapMask *gap_mask = nullptr;
+	vector<uint32_t> v_column_lengths;
+	if (!block.v_gap_mask.empty())
+	{
+		gap_mask = new CGapMask();
+		if (!gap_mask->Decode(block.v_gap_mask, vec_len, column_info ? column_info->NoRegular() : n_vecs))
+		{
+			cerr << "Corrupted gap mask\n";
+			delete gap_mask;
+			delete column_info;
+			return false;
+		}
 
-		// RLE-0
-		CRLE *rle = new CRLE(q_post_entropy, q_post_RLE, RLE0_rev_mode);
-		thread *thr_rle = new thread(std::ref(*rle));
+		for (size_t i = 0; i < gap_mask->Size(); ++i)
+			if (gap_mask->NoResidues(i))
+				v_column_lengths.push_back(gap_mask->NoResidues(i));
+	}
 
-		vector<CSecondStage *> v_ss(n_thr_ss);
-		vector<thread *> v_thr_ss(n_thr_ss);
+	CVectorIOStream *v_pre_entropy = new CVectorIOStream(block.v_data);
+	CRegisteringPriorityQueue<string> *q_post_entropy = new CRegisteringPriorityQueue<string>(1);
+	CRegisteringPriorityQueue<string> *q_post_RLE = new CRegisteringPriorityQueue<string>(1);
+	CRegisteringPriorityQueue<string> *q_post_SS = new CRegisteringPriorityQueue<string>(n_thr_ss);
+	CRegisteringPriorityQueue<string> *q_post_PBWT = new CRegisteringPriorityQueue<string>(1);
+	CRegisteringPriorityQueue<vector<string> *> *q_post_transpose = new CRegisteringPriorityQueue<vector<string> *>(1);
+
+	// Entropy
+	CEntropy *entropy = nullptr;
+	thread *thr_entropy = nullptr;
+	if (v_columns)
+	{
+		for (size_t i = 0; i < v_columns->size(); ++i)
+			q_post_entropy->Push(i, move((*v_columns)[i]));
+		q_post_entropy->MarkCompleted();
+	}
+	else
+	{
+		entropy = new CEntropy(q_post_entropy, v_pre_entropy, block.pre_entropy_size, vec_len, false, entropy_params(block, block.entropy_blocks ? ENTROPY_BLOCK_SIZE : 0), 
+			n_threads, gap_mask ? &v_column_lengths : nullptr, &entropy_coder_pool);
+		thr_entropy = new thread(std::ref(*entropy));
+	}
+
+	// RLE-0 (unless zero-runs are decoded by the entropy decoder)
+	CRLE *rle = nullptr;
+	thread *thr_rle = nullptr;
+	CRegisteringPriorityQueue<string> *q_pre_SS = q_post_entropy;
+	if (!block.run_lengths)
+	{
+		rle = new CRLE(q_post_entropy, q_post_RLE, RLE0_rev_mode);
+		thr_rle = new thread(std::ref(*rle));
+		q_pre_SS = q_post_RLE;
+	}
 
-		if (fast_variant)
+	vector<CSecondStage *> v_ss(n_thr_ss);
+	vector<thread *> v_thr_ss(n_thr_ss);
+
+	if (block.fast_variant)
+	{
+		// MTF
+		for (int i = 0; i < n_thr_ss; ++i)
 		{
-			// MTF
-			for (int i = 0; i < n_thr_ss; ++i)
-			{
-				v_ss[i] = new CMTF(q_post_RLE, q_post_SS, SS_rev_mode);
-				v_thr_ss[i] = new thread(std::ref(*(v_ss[i])));
-			}
+			v_ss[i] = new CMTF(q_pre_SS, q_post_SS, SS_rev_mode);
+			v_thr_ss[i] = new thread(std::ref(*(v_ss[i])));
 		}
-		else
+	}
+	else
+	{
+		// WFC
+		for (int i = 0; i < n_thr_ss; ++i)
 		{
-			// WFC
-			for (int i = 0; i < n_thr_ss; ++i)
-			{
-				v_ss[i] = new CWFC(q_post_RLE, q_post_SS, SS_rev_mode);
-				v_thr_ss[i] = new thread(std::ref(*(v_ss[i])));
-			}
+			v_ss[i] = new CWFC(q_pre_SS, q_post_SS, SS_rev_mode);
+			v_thr_ss[i] = new thread(std::ref(*(v_ss[i])));
 		}
+	}
 
-		// PBWT
-		CPBWT *pbwt = new CPBWT(q_post_SS, q_post_PBWT, PBWT_rev_mode);
-		thread *thr_pbwt = new thread(std::ref(*pbwt));
+	// PBWT
+	CPBWT *pbwt = new CPBWT(q_post_SS, q_post_PBWT, PBWT_rev_mode, column_info, gap_mask, vec_len, n_vecs);
+	thread *thr_pbwt = new thread(std::ref(*pbwt));
 
-		// Transpose
-		CTranspose *transpose = new CTranspose(q_post_transpose, q_post_PBWT, n_sequences, n_columns, Transpose_rev_mode);
-		thread *thr_transpose = new thread(std::ref(*transpose));
+	// Transpose
+	CTranspose *transpose = new CTranspose(q_post_transpose, q_post_PBWT, n_sequences, n_columns, Transpose_rev_mode);
+	thread *thr_transpose = new thread(std::ref(*transpose));
 
+	if (thr_entropy)
 		thr_entropy->join();
+	if (thr_rle)
 		thr_rle->join();
-		for (auto &x : v_thr_ss)
-			x->join();
+	for (auto &x : v_thr_ss)
+		x->join();
 
-		thr_pbwt->join();
-		thr_transpose->join();
+	thr_pbwt->join();
+	thr_transpose->join();
 
-		vector<string> *matrix = nullptr;
-		uint64_t priority;
-		q_post_transpose->Pop(priority, matrix);
-		v_sequences.resize(matrix->size());
+	bool entropy_corrupted = entropy && entropy->IsCorrupted();
+	bool pbwt_corrupted = pbwt->IsCorrupted();
 
-		for (size_t i = 0; i < matrix->size(); ++i)
-			v_sequences[i] = move((*matrix)[i]);
+	vector<string> *matrix = nullptr;
+	uint64_t priority;
+	q_post_transpose->Pop(priority, matrix);
+	v_sequences.resize(matrix->size());
 
-		delete entropy;
-		delete thr_entropy;
+	for (size_t i = 0; i < matrix->size(); ++i)
+		v_sequences[i] = move((*matrix)[i]);
 
-		delete rle;
-		delete thr_rle;
+	delete matrix;
 
-		for (int i = 0; i < n_thr_ss; ++i)
-		{
-			delete v_ss[i];
-			delete v_thr_ss[i];
-		}
+	delete entropy;
+	delete thr_entropy;
 
-		delete pbwt;
-		delete thr_pbwt;
+	delete rle;
+	delete thr_rle;
 
-		delete transpose;
-		delete thr_transpose;
+	for (int i = 0; i < n_thr_ss; ++i)
+	{
+		delete v_ss[i];
+		delete v_thr_ss[i];
+	}
 
-		delete v_pre_entropy;
-		delete q_post_entropy;
-		delete q_post_RLE;
-		delete q_post_SS;
-		delete q_post_PBWT;
-		delete q_post_transpose;
+	delete pbwt;
+	delete thr_pbwt;
+
+	delete transpose;
+	delete thr_transpose;
+
+	delete column_info;
+	delete gap_mask;
+
+	delete v_pre_entropy;
+	delete q_post_entropy;
+	delete q_post_RLE;
+	delete q_post_SS;
+	delete q_post_PBWT;
+	delete q_post_transpose;
+
+	if (entropy_corrupted)
+	{
+		cerr << "Corrupted index of entropy coded blocks\n";
+		return false;
 	}
-	else
-		v_sequences.clear();
 
-	thr_lzma->join();
-	delete lzma;
-	delete thr_lzma;
+	if (pbwt_corrupted)
+	{
+		cerr << "Corrupted columns in gPBWT stage\n";
+		return false;
+	}
 
 	return true;
 }
@@ -20,12 +20,101 @@
 #include "entropy.h"
 
 #include "lzma_wrapper.h"
+#include "meta_codec.h"
 
 using namespace std;
 
 const uint32_t LZMA_mode_FASTA = 9 | LZMA_PRESET_EXTREME;
 const uint32_t LZMA_mode_Stockholm = 9;
 
+// Automatic selection of the second stage (MTF/WFC)
+const size_t AUTO_MIN_TRIAL_SIZE = 10000;			// tiny families are compressed with WFC (the trial costs more than the gain)
+const size_t AUTO_SAMPLE_SIZE = 1000000;			// max. no. of symbols in the sample
+const size_t AUTO_SAMPLE_FRACTION = 32;				// the sample contains 1/32 of the columns (unless it would exceed AUTO_SAMPLE_SIZE)
+const size_t AUTO_MIN_SAMPLE_COLUMNS = 16;
+const double AUTO_MIN_WFC_GAIN = 0.01;				// WFC is used only if it gives at least 1% smaller output
+
+enum class second_stage_t {wfc, mtf, automatic};
+
+const size_t COLUMN_INFO_MIN_SIZE = 10000;			// for tiny families the description of columns does not pay off
+const size_t GAP_MASK_MIN_SIZE = 10000;				// for tiny families the separate gap stream does not pay off
+const size_t SUB_MATRICES_MIN_SIZE = 10000;			// tiny families are not split into match and insert sub-matrices
+const size_t HUFFMAN_MIN_SIZE = 100000;				// for small families the code tables do not pay off (range coder is used)
+const size_t RUN_LENGTHS_MIN_SIZE = 1000000;			// small families are better coded with RLE-0 digits (the models of runs learn slowly)
+
+// Super-blocks of consecutive small families sharing the models of entropy coder and LZMA stream
+const size_t SUPER_BLOCK_FAMILY_MAX_SIZE = 10000;	// larger families are compressed alone (must not exceed the thresholds above)
+const size_t SUPER_BLOCK_SIZE = 1000000;			// max. no. of symbols in a super-block (bounds the cost of extraction)
+const size_t SUPER_BLOCK_MAX_FAMILIES = 1024;
+
+static_assert(SUPER_BLOCK_FAMILY_MAX_SIZE <= COLUMN_INFO_MIN_SIZE && SUPER_BLOCK_FAMILY_MAX_SIZE <= GAP_MASK_MIN_SIZE && SUPER_BLOCK_FAMILY_MAX_SIZE <= SUB_MATRICES_MIN_SIZE,
+	"side info of families of a super-block is not stored");
+
+// Preset dictionary of LZMA for names and metadata of Stockholm families (trained on the first families)
+const size_t TEXT_DICTIONARY_SIZE = 1 << 16;
+const size_t TEXT_DICTIONARY_SAMPLE_FAMILIES = 1000;
+const size_t TEXT_DICTIONARY_SAMPLE_SIZE = 1 << 24;	// max. total size of texts in the sample
+
+// Symbols onto which per-column annotations are mapped (the first ones in the initial order of MTF/WFC,
+// as the later ranks are not supported by the entropy coder)
+const string ANNOTATION_SYMBOLS = "-.ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz*";
+const size_t ANNOTATION_MIN_SIZE = 1 << 14;		// smaller annotations are compressed (better) by LZMA with the text
+
+// The first byte of the block with preset dictionary (no family starts with this value)
+const uint8_t BLOCK_TEXT_DICTIONARY = 16;
+
+// Flags in the first byte of compressed family (the lowest bits contain ctx_length)
+const uint8_t FAMILY_FLAG_SUPER_BLOCK = 32;			// several families in a single block
+const uint8_t FAMILY_FLAG_FAST_VARIANT = 64;
+const uint8_t FAMILY_FLAG_EXTENDED = 128;			// extended flags follow
+
+// Extended flags
+const uint32_t EXT_FLAG_COLUMN_INFO = 1;			// constant, repeated and near-constant columns are described separately
+const uint32_t EXT_FLAG_GAP_MASK = 2;				// gaps are coded separately from residues
+const uint32_t EXT_FLAG_SUB_MATRICES = 4;			// match and insert columns are compressed as separate sub-matrices
+const uint32_t EXT_FLAG_ENTROPY_BLOCKS = 8;			// entropy coded stream consists of independent blocks
+const uint32_t EXT_FLAG_HUFFMAN = 16;				// static Huffman codes in place of range coder
+const uint32_t EXT_FLAG_RUN_LENGTHS = 32;			// zero-runs are coded by the entropy coder (no RLE-0 stage)
+const uint32_t EXT_FLAG_TEXT_DICTIONARY = 64;		// names and metadata are coded by raw LZMA2 with the preset dictionary of the archive
+const uint32_t EXT_FLAG_GS_FIELDS = 128;			// fields of #=GS lines are stored in separate streams of text
+const uint32_t EXT_FLAG_ANNOTATION_ROWS = 256;		// per-column annotations (#=GR, #=GC lines) are compressed as a separate matrix
+
+// *******************************************************************************************
+// Compressed alignment
+struct seq_block_t {
+	ctx_length_t ctx_length;
+	bool fast_variant;
+	bool entropy_blocks;
+	entropy_backend_t entropy_backend;
+	bool run_lengths;
+	size_t pre_entropy_size;
+	vector<uint8_t> v_column_info;
+	vector<uint8_t> v_gap_mask;
+	vector<uint8_t> v_data;
+
+	seq_block_t() : ctx_length(ctx_length_t::tiny), fast_variant(false), entropy_blocks(false), entropy_backend(entropy_backend_t::range_coder), run_lengths(false), pre_entropy_size(0)
+	{};
+
+	size_t size() const
+	{
+		return v_column_info.size() + v_gap_mask.size() + v_data.size();
+	}
+};
+
+// *******************************************************************************************
+// Family of a super-block
+struct msa_family_t {
+	vector<vector<uint8_t>> v_meta;
+	vector<uint32_t> v_offsets;
+	vector<string> v_names;
+	vector<string> v_sequences;
+
+	size_t size() const
+	{
+		return v_sequences.empty() ? 0 : v_sequences.size() * v_sequences.front().size();
+	}
+};
+
 // *******************************************************************************************
 //
 // *******************************************************************************************
@@ -41,12 +130,54 @@ class CMSACompress
 	stage_mode_t SS_fwd_mode, SS_rev_mode;
 	stage_mode_t RLE0_fwd_mode, RLE0_rev_mode;
 
-	size_t pre_entropy_sequences_size;
-	bool fast_variant;
+	second_stage_t second_stage;
+	bool column_info_mode;
+	bool gap_mask_mode;
+	bool sub_matrices_mode;
+	size_t entropy_block_size;
+	entropy_backend_t entropy_backend;
+	bool run_lengths_mode;
+	bool ctx_trial_mode;
+	bool gs_fields_mode;
+	bool annotation_rows_mode;
+	int n_threads;
+	int n_entropy_threads;							// threads of the entropy stage during compression (the rest is used by LZMA)
+
+	CEntropyCoderPool entropy_coder_pool;			// entropy coders (with their models) reused by consecutive families
+	CLZMAStreams lzma_streams;						// LZMA coders (with their buffers) reused by consecutive families
+	vector<uint8_t> v_text_dictionary;				// preset dictionary of LZMA (empty if not used)
+	bool text_dictionary_used;						// the text of current family is coded with the preset dictionary
+	CMetaCodec meta_codec;
+	bool gs_fields_used;							// #=GS lines of current family are coded in separate streams
+	vector<vector<uint8_t>> v_meta_rest;
+	vector<vector<uint8_t>> v_gs_streams;
+	vector<vector<uint8_t>> v_meta_prefixes;		// metadata with per-column annotations cut off
+	vector<string> v_annotations;					// per-column annotations (rows of a separate matrix)
+	vector<uint32_t> v_annotated_lines;				// gaps between the metadata lines of annotations
+	vector<uint8_t> v_annotation_alphabet;			// symbols of annotations (in the order of ANNOTATION_SYMBOLS)
+
+	ctx_length_t select_ctx_length(size_t file_size);
+	int split_threads(size_t text_size);
 
 	bool compress(vector<uint8_t> &v_text, vector<string> &v_sequences, uint32_t LZMA_mode, vector<uint8_t> &v_compressed_data,
-		size_t &comp_text_size, size_t &comp_seq_size);
-	bool decompress(vector<uint8_t> &v_text, vector<string> &v_sequences, vector<uint8_t> &v_compressed_data);
+		size_t &comp_text_size, size_t &comp_seq_size, vector<string> *v_annotations = nullptr);
+	bool decompress(vector<uint8_t> &v_text, vector<string> &v_sequences, vector<uint8_t> &v_compressed_data, vector<string> *v_annotations = nullptr);
+
+	void compress_matrix(vector<string> &v_sequences, seq_block_t &block);
+	size_t configure_entropy(seq_block_t &block, size_t n_symbols);
+	entropy_params_t entropy_params(const seq_block_t &block, size_t block_size);
+	void compress_sequences(vector<string> &v_sequences, seq_block_t &block, bool ctx_trial = true, vector<string> *v_columns = nullptr);
+	bool decompress_sequences(seq_block_t &block, uint32_t n_sequences, uint32_t n_columns, vector<string> &v_sequences, vector<string> *v_columns = nullptr);
+
+	void compress_super_block(vector<msa_family_t> &v_families, seq_block_t &block);
+
+	bool wfc_pays_off(size_t size_mtf, size_t size_wfc);
+	bool sample_trial(vector<string> &v_sequences, ctx_length_t ctx_length);
+
+	bool split_columns(vector<string> &v_sequences, vector<bool> &v_insert_columns, vector<string> &v_match, vector<string> &v_insert);
+	void merge_columns(vector<bool> &v_insert_columns, vector<string> &v_match, vector<string> &v_insert, vector<string> &v_sequences);
+	void encode_column_classes(vector<bool> &v_insert_columns, vector<uint8_t> &v_compressed);
+	void decode_column_classes(vector<uint8_t> &v_compressed, uint32_t n_columns, vector<bool> &v_insert_columns);
 
 	void append_text(vector<string> &vs);
 	void append_text(vector<vector<uint8_t>> &vs);
@@ -56,29 +187,68 @@ class CMSACompress
 	void load_text(vector<vector<uint8_t>> &vs);
 	void load_text(vector<uint32_t> &vu);
 
+	void append_stream(vector<uint8_t> &vu);
+	void load_stream(vector<uint8_t> &vu);
+
+	void append_family_text(vector<vector<uint8_t>> &v_meta, vector<string> &v_names, vector<uint32_t> &v_offsets);
+	bool load_family_text(vector<vector<uint8_t>> &v_meta, vector<string> &v_names, vector<uint32_t> &v_offsets);
+
+	bool split_annotations(vector<vector<uint8_t>> &v_meta, size_t n_columns);
+	bool merge_annotations(vector<vector<uint8_t>> &v_meta);
+	vector<size_t> annotation_order(const vector<vector<uint8_t>> &v_meta);
+	void append_stockholm_text(vector<vector<uint8_t>> &v_meta, vector<string> &v_names, vector<uint32_t> &v_offsets, vector<string> &v_sequences);
+
 	void store_uint(vector<uint8_t> &vu, size_t x);
 	size_t load_uint(vector<uint8_t> &vu, size_t &vu_pos);
 
-	void store_data_in_stream(ctx_length_t ctx_length, bool fast_variant, vector<uint8_t> &v_seq_compressed, vector<uint8_t> &v_text_compressed, size_t pre_entropy_sequences_size,
-		uint32_t n_sequences, uint32_t n_columns, vector<uint8_t> &v_compressed_data);
-	void load_data_from_stream(ctx_length_t &ctx_length, bool &fast_variant, vector<uint8_t> &v_seq_compressed, vector<uint8_t> &v_text_compressed, size_t &pre_entropy_sequences_size,
-		uint32_t &n_sequences, uint32_t &n_columns, vector<uint8_t> &v_compressed_data);
+	uint32_t block_flags(seq_block_t &block);
+	void store_block_sizes(seq_block_t &block, uint32_t flags, vector<uint8_t> &v_compressed_data);
+	void load_block_sizes(seq_block_t &block, uint32_t flags, vector<uint8_t> &v_compressed_data, size_t &vu_pos);
+	void store_block_data(seq_block_t &block, vector<uint8_t> &v_compressed_data);
+	void load_block_data(seq_block_t &block, vector<uint8_t> &v_compressed_data, size_t &vu_pos);
+
+	void store_data_in_stream(seq_block_t &block, seq_block_t &block_insert, seq_block_t &block_annotations, vector<uint8_t> &v_column_classes, 
+		vector<uint8_t> &v_text_compressed, uint32_t n_sequences, uint32_t n_columns, uint32_t n_insert_columns, uint32_t n_annotation_rows, 
+		vector<uint8_t> &v_compressed_data);
+	void load_data_from_stream(seq_block_t &block, seq_block_t &block_insert, seq_block_t &block_annotations, vector<uint8_t> &v_column_classes, 
+		vector<uint8_t> &v_text_compressed, uint32_t &n_sequences, uint32_t &n_columns, uint32_t &n_insert_columns, uint32_t &n_annotation_rows, 
+		vector<uint8_t> &v_compressed_data);
 
 public:
 	CMSACompress();
 	~CMSACompress();
 
+	void SetColumnInfoMode(bool _column_info_mode);
+	void SetGapMaskMode(bool _gap_mask_mode);
+	void SetSubMatricesMode(bool _sub_matrices_mode);
+	void SetEntropyBlockSize(size_t _entropy_block_size);
+	void SetEntropyBackend(entropy_backend_t _entropy_backend);
+	void SetRunLengthsMode(bool _run_lengths_mode);
+	void SetCtxTrialMode(bool _ctx_trial_mode);
+	void SetGSFieldsMode(bool _gs_fields_mode);
+	void SetAnnotationRowsMode(bool _annotation_rows_mode);
+	void SetNoThreads(int _n_threads);
+
 #ifdef EXPERIMENTAL_MODE
 	void SetCopyModes(bool Transpose_copy_mode, bool PBWT_copy_mode, bool SS_copy_mode, bool RLE0_copy_mode);
 #endif
 
 	bool Compress(vector<string> &v_names, vector<string> &v_sequences, vector<uint8_t> &compressed_data, 
-		size_t &comp_text_size, size_t &comp_seq_size, bool _fast_variant);
+		size_t &comp_text_size, size_t &comp_seq_size, second_stage_t _second_stage);
 	bool Compress(vector<vector<uint8_t>> &v_meta, vector<uint32_t> &v_offsets, vector<string> &v_names, vector<string> &v_sequences, vector<uint8_t> &v_compressed_data,
-		size_t &comp_text_size, size_t &comp_seq_size, bool _fast_variant);
+		size_t &comp_text_size, size_t &comp_seq_size, second_stage_t _second_stage);
 
 	bool Decompress(vector<uint8_t> &v_compressed_data, vector<string> &v_names, vector<string> &v_sequences);
 	bool Decompress(vector<uint8_t> &v_compressed_data, vector<vector<uint8_t>> &v_meta, vector<uint32_t> &v_offsets, vector<string> &v_names, vector<string> &v_sequences);
+
+	bool CompressSuperBlock(vector<msa_family_t> &v_families, vector<uint8_t> &v_compressed_data, size_t &comp_text_size, size_t &comp_seq_size, 
+		second_stage_t _second_stage);
+	bool DecompressSuperBlock(vector<uint8_t> &v_compressed_data, vector<msa_family_t> &v_families, int family_no = -1);
+	static bool IsSuperBlock(vector<uint8_t> &v_compressed_data);
+
+	void TrainTextDictionary(vector<msa_family_t> &v_sample, vector<uint8_t> &v_compressed_data);
+	bool LoadTextDictionary(vector<uint8_t> &v_compressed_data);
+	static bool IsTextDictionary(vector<uint8_t> &v_compressed_data);
 };
 
 // EOF
@@ -9,14 +9,22 @@
 
 #include <iostream>
 #include <numeric>
+#include <algorithm>
 #include "pbwt.h"
+#include "simd.h"
 
 // *******************************************************************************************
 // Perform gPBWT 
 void CPBWT::forward()
 {
-	string src, dest;
+	string src, dest, residues;
 	uint64_t priority;
+	uint64_t out_priority = 0;
+
+	if (column_info)
+		column_info->Clear();
+	if (gap_mask)
+		gap_mask->Clear();
 
 	while (!in->IsCompleted())
 	{
@@ -39,6 +47,19 @@ void CPBWT::forward()
 		for (auto c : src)
 			++n_occ[c];
 
+		column_kind_t kind = column_kind_t::regular;
+
+		if (column_info)
+		{
+			kind = classify_column(src, n_occ);
+			if (kind != column_kind_t::repeated)
+				prev_column = src;
+
+			// The ordering is not changed by constant and repeated columns
+			if (kind == column_kind_t::constant || kind == column_kind_t::repeated)
+				continue;
+		}
+
 		vector<int> n_sum_occ(128, 0);
 		for (int i = 1; i < 128; ++i)
 			n_sum_occ[i] = n_sum_occ[i - 1] + n_occ[i - 1];
@@ -55,12 +76,86 @@ void CPBWT::forward()
 
 		prev_ordering.swap(curr_ordering);
 
-		out->Push(priority, dest);
+		if (kind != column_kind_t::regular)
+			continue;
+
+		if (gap_mask)
+		{
+			gap_mask->AddColumn(dest, residues);
+			if (!residues.empty())
+				out->Push(out_priority++, residues);
+		}
+		else if (column_info)
+			out->Push(out_priority++, dest);
+		else
+			out->Push(priority, dest);
 	}
 
 	out->MarkCompleted();
 }
 
+// *******************************************************************************************
+// Check whether the column can bypass the rest of the pipeline and register it in column info
+column_kind_t CPBWT::classify_column(const string &src, const vector<int> &n_occ)
+{
+	if (src == prev_column)
+	{
+		column_info->AddRepeated();
+		return column_kind_t::repeated;
+	}
+
+	int dominant = (int) (max_element(n_occ.begin(), n_occ.end()) - n_occ.begin());
+	size_t n_exceptions = src.size() - n_occ[dominant];
+
+	if (n_exceptions == 0)
+	{
+		column_info->AddConstant((uint8_t) dominant);
+		return column_kind_t::constant;
+	}
+
+	if (n_exceptions > NEAR_CONSTANT_MAX_EXCEPTIONS || n_exceptions * NEAR_CONSTANT_MIN_RATIO > src.size())
+	{
+		column_info->AddRegular();
+		return column_kind_t::regular;
+	}
+
+	v_exceptions.clear();
+
+	const uint8_t *p = (const uint8_t *) src.data();
+	size_t n = src.size();
+
+	for (size_t i = find_first_not_of(p, n, (uint8_t) dominant); i < n; i += 1 + find_first_not_of(p + i + 1, n - i - 1, (uint8_t) dominant))
+		v_exceptions.push_back(make_pair((uint32_t) i, p[i]));
+
+	column_info->AddNearConstant((uint8_t) dominant, v_exceptions);
+
+	return column_kind_t::near_constant;
+}
+
+// *******************************************************************************************
+// Update ordering according to the column (in the original order of rows)
+void CPBWT::update_ordering(const string &column)
+{
+	vector<int> n_occ(128, 0);
+
+	for (auto c : column)
+		++n_occ[c];
+
+	vector<int> n_sum_occ(128, 0);
+	for (int i = 1; i < 128; ++i)
+		n_sum_occ[i] = n_sum_occ[i - 1] + n_occ[i - 1];
+
+	for (size_t i = 0; i < prev_ordering.size(); ++i)
+	{
+		int c_symbol = column[prev_ordering[i]];
+		int c_pos = n_sum_occ[c_symbol]++;
+
+		curr_ordering[c_pos] = prev_ordering[i];
+	}
+
+	prev_ordering.swap(curr_ordering);
+}
+
 // *******************************************************************************************
 // Perform direct copy - just for debug purposes
 void CPBWT::direct_copy()
@@ -136,12 +231,79 @@ void CPBWT::reverse()
 	out->MarkCompleted();
 }
 
+// *******************************************************************************************
+// Do reverse gPBWT with some columns given by their descriptions (column info) and/or
+// only residues of columns coming from the previous stage (gap mask)
+void CPBWT::reverse_side_info()
+{
+	string src, dest, permuted;
+	uint64_t priority;
+	size_t mask_column = 0;
+
+	prev_ordering.resize(n_sequences);
+	iota(prev_ordering.begin(), prev_ordering.end(), 0);
+	curr_ordering.resize(n_sequences);
+	dest.resize(n_sequences);
+	permuted.resize(n_sequences);
+
+	if (column_info)
+		n_columns = column_info->Size();
+
+	for (size_t i = 0; i < n_columns; ++i)
+	{
+		switch (column_info ? column_info->Kind(i) : column_kind_t::regular)
+		{
+		case column_kind_t::regular:
+			if (gap_mask && gap_mask->NoResidues(mask_column) == 0)
+				src.clear();
+			else if (!in->Pop(priority, src) || src.size() != (gap_mask ? gap_mask->NoResidues(mask_column) : n_sequences))
+			{
+				corrupted = true;
+				break;
+			}
+
+			if (gap_mask)
+				gap_mask->ExpandColumn(mask_column++, src, permuted);
+			else
+				permuted.swap(src);
+
+			for (size_t j = 0; j < prev_ordering.size(); ++j)
+				dest[prev_ordering[j]] = permuted[j];
+
+			update_ordering(dest);
+			break;
+		case column_kind_t::constant:
+			fill(dest.begin(), dest.end(), (char) column_info->Symbol(i));
+			break;
+		case column_kind_t::repeated:
+			// dest contains the previous column
+			break;
+		case column_kind_t::near_constant:
+			fill(dest.begin(), dest.end(), (char) column_info->Symbol(i));
+			for (auto p = column_info->ExceptionsBegin(i); p != column_info->ExceptionsEnd(i); ++p)
+				dest[p->first] = (char) p->second;
+
+			update_ordering(dest);
+			break;
+		}
+
+		if (corrupted)
+			break;
+
+		out->Push(i, dest);
+	}
+
+	out->MarkCompleted();
+}
+
 // *******************************************************************************************
 // Do processing
 void CPBWT::operator()()
 {
 	if (stage_mode == stage_mode_t::forward)
 		forward();
+	else if (stage_mode == stage_mode_t::reverse && (column_info || gap_mask))
+		reverse_side_info();
 	else if (stage_mode == stage_mode_t::reverse)
 		reverse();
 	else if (stage_mode == stage_mode_t::copy_forward || stage_mode == stage_mode_t::copy_reverse)
@@ -14,6 +14,8 @@
 
 #include "queue.h"
 #include "defs.h"
+#include "column_info.h"
+#include "gap_mask.h"
 
 using namespace std;
 
@@ -26,22 +28,43 @@ class CPBWT
 	CRegisteringPriorityQueue<string> *out;
 	stage_mode_t stage_mode;
 
+	// Optional descriptions of columns that bypass the stages after gPBWT
+	CColumnInfo *column_info;
+	// Optional gap mask - only residues are passed to the stages after gPBWT
+	CGapMask *gap_mask;
+	size_t n_sequences;
+	size_t n_columns;
+	bool corrupted;
+	string prev_column;
+	vector<pair<uint32_t, uint8_t>> v_exceptions;
+
 	vector<int> prev_ordering;
 	vector<int> curr_ordering;
 
 	void forward();
 	void reverse();
+	void reverse_side_info();
 	void direct_copy();
 
+	column_kind_t classify_column(const string &src, const vector<int> &n_occ);
+	void update_ordering(const string &column);
+
 public:
-	CPBWT(CRegisteringPriorityQueue<string> *_in, CRegisteringPriorityQueue<string> *_out, stage_mode_t _stage_mode) : 
-		in(_in), out(_out), stage_mode(_stage_mode)
+	CPBWT(CRegisteringPriorityQueue<string> *_in, CRegisteringPriorityQueue<string> *_out, stage_mode_t _stage_mode, 
+		CColumnInfo *_column_info = nullptr, CGapMask *_gap_mask = nullptr, size_t _n_sequences = 0, size_t _n_columns = 0) : 
+		in(_in), out(_out), stage_mode(_stage_mode), column_info(_column_info), gap_mask(_gap_mask), n_sequences(_n_sequences), n_columns(_n_columns), corrupted(false)
 	{
 		if (!in || !out)
 			throw "No I/O queues";
 	};
 
 	void operator()();
+
+	// True if the reverse stage got fewer or shorter columns than given by the side info
+	bool IsCorrupted() const
+	{
+		return corrupted;
+	}
 };
 
 // EOF
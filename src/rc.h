@@ -11,16 +11,44 @@
 #include "defs.h"
 #include "sub_rc.h"
 #include <cmath>
+#include <algorithm>
+
+const uint32_t SIMPLE_MODEL_TREE_MIN_SYMBOLS = 64;		// for large alphabets cumulative frequencies are kept in a Fenwick tree
 
 // *******************************************************************************************
-//
+// Adaptive frequency model.
+// For large alphabets the linear scans of stats are replaced by a Fenwick tree of the same
+// frequencies (logarithmic prefix sums and search), so both variants give identical results.
 // *******************************************************************************************
 class CSimpleModel
 {
 	uint32_t n_symbols;
 	uint32_t max_total;
 	uint32_t *stats;
+	uint32_t *tree;				// 1-based Fenwick tree of stats (nullptr for small alphabets)
+	uint32_t tree_size;			// n_symbols rounded up to a power of 2 (padded with zero frequencies)
 	uint32_t total;
+	bool own_memory;			// false if stats and tree are placed in external memory (arena)
+
+	static uint32_t calc_tree_size(uint32_t n_symbols)
+	{
+		if (n_symbols < SIMPLE_MODEL_TREE_MIN_SYMBOLS)
+			return 0;
+
+		uint32_t r;
+		for (r = 1; r < n_symbols; r *= 2)
+			;
+
+		return r;
+	}
+
+	void release()
+	{
+		if (own_memory && stats)
+			delete[] stats;
+		stats = nullptr;
+		tree = nullptr;
+	}
 
 	void rescale()
 	{
@@ -30,37 +58,84 @@ class CSimpleModel
 			stats[i] = (stats[i] + 1) / 2;
 			total += stats[i];
 		}
+
+		if (tree)
+			build_tree();
+	}
+
+	void build_tree()
+	{
+		tree[0] = 0;
+		copy_n(stats, n_symbols, tree + 1);
+		fill(tree + n_symbols + 1, tree + tree_size + 1, 0);
+
+		for (uint32_t i = 1; i < tree_size; ++i)
+			tree[i + (i & (0 - i))] += tree[i];
+	}
+
+	uint32_t prefix_sum(uint32_t symbol)
+	{
+		uint32_t r = 0;
+
+		if (tree)
+			for (uint32_t i = symbol; i; i -= i & (0 - i))
+				r += tree[i];
+		else
+			for (uint32_t i = 0; i < symbol; ++i)
+				r += stats[i];
+
+		return r;
 	}
 
 public: 
-	CSimpleModel() : n_symbols(0), stats(nullptr)
+	CSimpleModel() : n_symbols(0), stats(nullptr), tree(nullptr), own_memory(true)
 	{};
 
 	~CSimpleModel()
 	{
-		if (stats)
-			delete[] stats;
+		release();
 	};
 
-	void Init(uint32_t _n_symbols, uint32_t _max_total)
+	// No. of 32-bit words necessary for the model of given no. of symbols
+	static uint32_t MemorySize(uint32_t n_symbols)
 	{
-		if (stats)
-			delete[] stats;
+		uint32_t t_size = calc_tree_size(n_symbols);
+
+		return n_symbols + (t_size ? t_size + 1 : 0);
+	}
+
+	// If memory is given (of MemorySize() words), the model is placed there and does not own it
+	void Init(uint32_t _n_symbols, uint32_t _max_total, uint32_t *memory = nullptr)
+	{
+		release();
+
 		n_symbols = _n_symbols;
 		max_total = _max_total;
+		tree_size = calc_tree_size(n_symbols);
 
-		stats = new uint32_t[n_symbols];
+		own_memory = memory == nullptr;
+		if (own_memory)
+			memory = new uint32_t[MemorySize(n_symbols)];
+
+		stats = memory;
+		tree = tree_size ? memory + n_symbols : nullptr;
+
+		Reset();
+	}
+
+	// Restore initial (flat) statistics in place
+	void Reset()
+	{
 		fill_n(stats, n_symbols, 1);
 		total = n_symbols;
+
+		if (tree)
+			build_tree();
 	}
 
 	void GetFreq(int symbol, int &sym_freq, int &left_freq, int &totf)
 	{
-		left_freq = 0;
-
-		for (int i = 0; i < symbol; ++i)
-			left_freq += stats[i];
-
+		left_freq = (int) prefix_sum(symbol);
 		sym_freq = stats[symbol];
 		totf = total;
 	}
@@ -70,19 +145,59 @@ public:
 		stats[symbol]++;
 		total++;
 
+		if (tree)
+			for (uint32_t i = symbol + 1; i <= tree_size; i += i & (0 - i))
+				tree[i]++;
+
 		if (total >= max_total)
 			rescale();
 	}
 
 	int GetSym(int left_freq)
 	{
+		int sym_freq, sym_left_freq;
+
+		return GetSymFreq(left_freq, sym_freq, sym_left_freq);
+	}
+
+	// Find symbol for given cumulative frequency and return also its frequency and cumulative frequency
+	int GetSymFreq(int left_freq, int &sym_freq, int &sym_left_freq)
+	{
+		if (tree)
+		{
+			// The largest position with prefix sum not greater than left_freq (branchless descent)
+			uint32_t pos = 0;
+			uint32_t rest = (uint32_t) left_freq;
+
+			for (uint32_t step = tree_size / 2; step; step >>= 1)
+			{
+				uint32_t t = tree[pos + step];
+				uint32_t mask = 0 - (uint32_t) (t <= rest);
+				pos += step & mask;
+				rest -= t & mask;
+			}
+
+			if (pos >= n_symbols)
+				return -1;
+
+			sym_freq = stats[pos];
+			sym_left_freq = left_freq - (int) rest;
+
+			return (int) pos;
+		}
+
 		int t = 0;
 
 		for (uint32_t i = 0; i < n_symbols; ++i)
 		{
-			t += stats[i];
-			if (t > left_freq)
+			if (t + (int) stats[i] > left_freq)
+			{
+				sym_freq = stats[i];
+				sym_left_freq = t;
+
 				return i;
+			}
+			t += stats[i];
 		}
 
 		return -1;
@@ -99,8 +214,8 @@ public:
 // *******************************************************************************************
 template<typename T_IO_STREAM> class CRangeCoderModel
 {
-	CRangeEncoder<CVectorIOStream> *rce;
-	CRangeDecoder<CVectorIOStream> *rcd;
+	CRangeEncoder<T_IO_STREAM> *rce;
+	CRangeDecoder<T_IO_STREAM> *rcd;
 
 	CSimpleModel simple_model;
 
@@ -110,12 +225,8 @@ template<typename T_IO_STREAM> class CRangeCoderModel
 	int rescale;
 	bool compress;
 
-public:
-	CRangeCoderModel(CBasicRangeCoder<T_IO_STREAM> *rcb, int _no_symbols, int _lg_totf, int _rescale, int* _init, bool _compress) :
-		no_symbols(_no_symbols), lg_totf(_lg_totf), totf(1 << _lg_totf), rescale(_rescale), compress(_compress)
+	void set_coder(CBasicRangeCoder<T_IO_STREAM> *rcb)
 	{
-		simple_model.Init(no_symbols, rescale);
-
 		if (compress)
 		{
 			rce = (CRangeEncoder<T_IO_STREAM>*) (rcb);
@@ -128,13 +239,50 @@ public:
 		}
 	}
 
+public:
+	CRangeCoderModel(CBasicRangeCoder<T_IO_STREAM> *rcb, int _no_symbols, int _lg_totf, int _rescale, int* _init, bool _compress)
+	{
+		Init(rcb, _no_symbols, _lg_totf, _rescale, _init, _compress);
+	}
+
+	// Model must be initialized by Init() before use
+	CRangeCoderModel() : rce(nullptr), rcd(nullptr), no_symbols(0), lg_totf(0), totf(1), rescale(0), compress(true)
+	{
+	}
+
 	~CRangeCoderModel()
 	{
 	}
 
+	// If memory is given (of MemorySize() words), the statistics are placed there
+	void Init(CBasicRangeCoder<T_IO_STREAM> *rcb, int _no_symbols, int _lg_totf, int _rescale, int* _init, bool _compress, uint32_t *memory = nullptr)
+	{
+		no_symbols = _no_symbols;
+		lg_totf = _lg_totf;
+		totf = 1 << _lg_totf;
+		rescale = _rescale;
+		compress = _compress;
+
+		simple_model.Init(no_symbols, rescale, memory);
+		set_coder(rcb);
+	}
+
+	static uint32_t MemorySize(int no_symbols)
+	{
+		return CSimpleModel::MemorySize(no_symbols);
+	}
+
+	// Restore initial statistics (in place)
 	void Reset()
 	{
-		simple_model.Init(no_symbols, rescale);
+		simple_model.Reset();
+	}
+
+	// Restore initial statistics (in place) and attach the model to another coder
+	void Reset(CBasicRangeCoder<T_IO_STREAM> *rcb)
+	{
+		simple_model.Reset();
+		set_coder(rcb);
 	}
 
 	void Encode(int x)
@@ -147,14 +295,13 @@ public:
 
 	int Decode()
 	{
-		int syfreq, ltfreq;
+		int syfreq = 0, ltfreq;
 
 		totf = simple_model.GetTotal();
 		ltfreq = rcd->GetCumulativeFreq(totf);
 
-		int x = simple_model.GetSym(ltfreq);
+		int x = simple_model.GetSymFreq(ltfreq, syfreq, ltfreq);
 
-		simple_model.GetFreq(x, syfreq, ltfreq, totf);
 		rcd->UpdateFrequency(syfreq, ltfreq, totf);
 		simple_model.Update(x);
 
@@ -162,4 +309,54 @@ public:
 	}
 };
 
+// *******************************************************************************************
+// Adaptive probability of a binary decision (the probability of 0 in RC_BIT_PROB_BITS precision).
+// It is updated by shifts only. Two estimates are kept: a fast one (BIT_MODEL_FAST_SHIFT) and
+// a slow one (BIT_MODEL_SLOW_SHIFT); the probability is their average. Both adapt quickly for
+// the first bits (the shifts grow with the no. of seen bits), so short contexts learn fast.
+// *******************************************************************************************
+const uint32_t BIT_MODEL_FAST_SHIFT = 6;
+const uint32_t BIT_MODEL_SLOW_SHIFT = 8;
+
+class CBitModel
+{
+	uint16_t p_fast;
+	uint16_t p_slow;
+	uint32_t shift;
+
+public:
+	CBitModel()
+	{
+		Reset();
+	}
+
+	void Reset()
+	{
+		p_fast = p_slow = (uint16_t) (1u << (RC_BIT_PROB_BITS - 1));
+		shift = 1;
+	}
+
+	// In [1, 2^RC_BIT_PROB_BITS - 1], since both estimates are in this range
+	uint32_t GetProb0() const
+	{
+		return ((uint32_t) p_fast + p_slow) >> 1;
+	}
+
+	void Update(uint32_t bit)
+	{
+		if (bit)
+		{
+			p_fast -= p_fast >> min(shift, BIT_MODEL_FAST_SHIFT);
+			p_slow -= p_slow >> shift;
+		}
+		else
+		{
+			p_fast += ((1u << RC_BIT_PROB_BITS) - p_fast) >> min(shift, BIT_MODEL_FAST_SHIFT);
+			p_slow += ((1u << RC_BIT_PROB_BITS) - p_slow) >> shift;
+		}
+
+		shift += shift < BIT_MODEL_SLOW_SHIFT;
+	}
+};
+
 // EOF
@@ -17,8 +17,6 @@ void CRLE::forward()
 	string src, dest;
 	uint64_t priority;
 
-	int n_vec = 0;
-
 	while (!in->IsCompleted())
 	{
 		if (!in->Pop(priority, src))
@@ -26,46 +24,22 @@ void CRLE::forward()
 
 		dest.clear();
 
-		src.push_back((char) 127);		// sentinel
-		int zero_len = 0;
-//		int one_len = 0;
-		int p_x = -1;
-
-		int enc_len = 0;
+		const uint8_t *p = (const uint8_t *) src.data();
+		size_t n = src.size();
 
-		for (auto x : src)
+		for (size_t i = 0; i < n; )
 		{
-			if (x != p_x)
+			if (p[i] == 0)
 			{
-				if (zero_len)
-				{
-					enc_len += zero_len;
-					emit_code(dest, zero_len, 125);
-					zero_len = 0;
-				}
-/*				else if (one_len)
-				{
-					emit_code(dest, one_len, 123);
-					one_len = 0;
-				}*/
+				// Zero-runs are long after WFC/MTF, so their ends are found by SIMD kernel
+				size_t zero_len = find_first_not_of(p + i, n - i, 0);
+				emit_code(dest, (int) zero_len, 125);
+				i += zero_len;
 			}
-
-			if (x == 0)
-				++zero_len;
-//			else if (x == 1)
-//				++one_len;
 			else
-			{
-				dest.push_back(x);
-				++enc_len;
-			}
-
-			p_x = x;
+				dest.push_back(p[i++]);
 		}
 
-		n_vec++;
-
-		dest.pop_back();		// remove sentinel
 		out->Push(priority, dest);
 	}
 
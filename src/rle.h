@@ -11,6 +11,7 @@
 #include <vector>
 #include "queue.h"
 #include "defs.h"
+#include "simd.h"
 
 // *******************************************************************************************
 //
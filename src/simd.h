@@ -0,0 +1,55 @@
+#pragma once
+// *******************************************************************************************
+// This file is a part of CoMSA software distributed under GNU GPL 3 licence.
+// The homepage of the CoMSA project is http://sun.aei.polsl.pl/REFRESH/CoMSA
+//
+// Author : Sebastian Deorowicz
+// Version: 1.2
+// Date   : 2018-10-04
+// *******************************************************************************************
+
+#include <cstdint>
+#include <cstddef>
+#include <emmintrin.h>
+
+#ifdef _WIN32
+#include <intrin.h>
+#endif
+
+using namespace std;
+
+// SSE2 is a part of x86-64, so the kernels need neither runtime detection nor extra compiler flags
+
+// *******************************************************************************************
+inline uint32_t count_trailing_zeros(uint32_t x)
+{
+#ifdef _WIN32
+	unsigned long r;
+	_BitScanForward(&r, x);
+	return (uint32_t) r;
+#else
+	return (uint32_t) __builtin_ctz(x);
+#endif
+}
+
+// *******************************************************************************************
+// Position of the first byte different than x (n if there is no such byte)
+inline size_t find_first_not_of(const uint8_t *p, size_t n, uint8_t x)
+{
+	__m128i vx = _mm_set1_epi8((char) x);
+	size_t i = 0;
+
+	for (; i + 16 <= n; i += 16)
+	{
+		uint32_t mask = (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (p + i)), vx)) ^ 0xffffu;
+		if (mask)
+			return i + count_trailing_zeros(mask);
+	}
+
+	for (; i < n && p[i] == x; ++i)
+		;
+
+	return i;
+}
+
+// EOF
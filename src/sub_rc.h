@@ -15,6 +15,8 @@
 #include "defs.h"
 #include <assert.h>
 
+const uint32_t RC_BIT_PROB_BITS = 16;			// precision of probabilities of binary decisions
+
 
 // *******************************************************************************************
 //
@@ -58,17 +60,23 @@ public:
 		low += range * cumFreq_;
 		range *= symFreq_;
 
-		while (range <= TopValue)
+		normalize();
+	}
+
+	// Binary decision; prob0 is the probability of 0 (in RC_BIT_PROB_BITS precision, nonzero)
+	void EncodeBit(uint32_t bit, Freq prob0)
+	{
+		Freq r = (range >> RC_BIT_PROB_BITS) * prob0;
+
+		if (bit)
 		{
-			assert(range != 0);
-			if ((low ^ (low + range)) & Mask64)
-			{
-				Freq r = (Freq)low;
-				range = (r | TopValue) - r;
-			}
-			io_stream.PutByte(low >> 56);
-			low <<= 8, range <<= 8;
+			low += r;
+			range -= r;
 		}
+		else
+			range = r;
+
+		normalize();
 	}
 
 	void End()
@@ -79,6 +87,22 @@ public:
 			low <<= 8;
 		}
 	}
+
+private:
+	void normalize()
+	{
+		while (range <= TopValue)
+		{
+			assert(range != 0);
+			if ((low ^ (low + range)) & Mask64)
+			{
+				Freq r = (Freq)low;
+				range = (r | TopValue) - r;
+			}
+			io_stream.PutByte(low >> 56);
+			low <<= 8, range <<= 8;
+		}
+	}
 };
 
 // *******************************************************************************************
@@ -117,10 +141,13 @@ public:
 		range = Mask32;
 	}
 
+	// The value is limited for corrupted data (the range would drop to 0 and the decoder would hang)
 	Freq GetCumulativeFreq(Freq totalFreq_)
 	{
 		assert(totalFreq_ != 0);
-		return (Freq) (buffer / (range /= totalFreq_));
+		Freq f = (Freq) (buffer / (range /= totalFreq_));
+
+		return f < totalFreq_ ? f : totalFreq_ - 1;
 	}
 
 	void UpdateFrequency(Freq symFreq_, Freq lowEnd_, Freq /*totalFreq_*/)
@@ -130,6 +157,37 @@ public:
 		low += r;
 		range *= symFreq_;
 
+		normalize();
+	}
+
+	// Binary decision; prob0 is the probability of 0 (in RC_BIT_PROB_BITS precision, nonzero)
+	uint32_t DecodeBit(Freq prob0)
+	{
+		Freq r = (range >> RC_BIT_PROB_BITS) * prob0;
+		uint32_t bit = buffer >= r;
+
+		if (bit)
+		{
+			buffer -= r;
+			low += r;
+			range -= r;
+		}
+		else
+			range = r;
+
+		normalize();
+
+		return bit;
+	}
+
+	void End()
+	{}
+
+private:
+	Code buffer;
+
+	void normalize()
+	{
 		while (range <= TopValue)
 		{
 			if ((low ^ (low + range)) & Mask64)
@@ -142,12 +200,6 @@ public:
 			low <<= 8, range <<= 8;
 		}
 	}
-
-	void End()
-	{}
-
-private:
-	Code buffer;
 };
 
 
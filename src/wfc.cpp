@@ -162,7 +162,8 @@ void CWFCCore::ResetCounts(uint32_t vec_size)
 	v = v_init;
 	v_sym_pos = v_sym_pos_init;
 
-	if (v_history.empty())
+	// Vectors can be of different lengths (e.g., residues only in gap mask mode)
+	if (v_history.size() < vec_size)
 		v_history.resize(vec_size);
 }
 